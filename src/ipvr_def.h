@@ -46,6 +46,19 @@
 
 #define IPVR_TIMEOUT_USEC 990000
 
+/*
+ * Drain the write-combining buffers so that CPU writes through a
+ * persistent WC mapping are visible to the device before submission
+ */
+static inline void ipvr_wc_flush(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("sfence" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
 #ifndef VA_FOURCC_YV16
 #define VA_FOURCC_YV16 0x36315659
 #endif
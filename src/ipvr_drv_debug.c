@@ -1186,7 +1186,7 @@ j=1309;k=0;
                 fprintf(ipvr_dump_vabuf_verbose_fp,"first 256 bytes:\n");
                 if (drm_ipvr_gem_bo_map(obj_buffer->ipvr_bo, 0))
                     return;
-                mapped_buffer = obj_buffer->ipvr_bo->virt;
+                mapped_buffer = (uint8_t *)obj_buffer->ipvr_bo->virt + obj_buffer->bo_offset;
 
                 for(j=0; j<256;++j) {
                     if(j%16 == 0) fprintf(ipvr_dump_vabuf_verbose_fp,"\n");
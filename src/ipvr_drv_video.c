@@ -48,6 +48,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
 #include <unistd.h>
 #include <linux/videodev2.h>
@@ -63,6 +64,7 @@
 #include "ipvr_drv_debug.h"
 
 #include "ved_vp8.h"
+#include "ved_execbuf.h"
 
 #ifdef ANDROID
 #include "android/ipvr_android.h"
@@ -877,6 +879,12 @@ VAStatus ipvr_CreateContext(
     memset(obj_context->buffers_unused_count, 0, sizeof(obj_context->buffers_unused_count));
     memset(obj_context->buffers_unused_tail, 0, sizeof(obj_context->buffers_unused_tail));
     memset(obj_context->buffers_active, 0, sizeof(obj_context->buffers_active));
+    obj_context->buffers_unused_hits = 0;
+    obj_context->buffers_unused_misses = 0;
+    obj_context->buffers_unused_stalls = 0;
+    memset(obj_context->prime_cache, 0, sizeof(obj_context->prime_cache));
+    obj_context->prime_cache_hits = 0;
+    obj_context->prime_cache_misses = 0;
 
     for (i = 0; i < num_render_targets; i++) {
         object_surface_p obj_surface = SURFACE(render_targets[i]);
@@ -960,14 +968,36 @@ static VAStatus ipvr__allocate_malloc_buffer(object_buffer_p obj_buffer, int siz
 {
     VAStatus vaStatus = VA_STATUS_SUCCESS;
 
+    /* keep a large enough block, e.g. one handed back by a decoder */
+    if (obj_buffer->buffer_data && obj_buffer->alloc_size >= (unsigned int)size)
+        return vaStatus;
+
     obj_buffer->buffer_data = realloc(obj_buffer->buffer_data, size);
     CHECK_ALLOCATION(obj_buffer->buffer_data);
+    obj_buffer->alloc_size = size;
 
     return vaStatus;
 }
 
 static VAStatus ipvr__unmap_buffer(object_buffer_p obj_buffer);
 
+/* BO backed buffers are allocated in 32K steps */
+#define IPVR_BO_BUFFER_SIZE(size) (((size) + 0x7fff) & ~0x7fff)
+
+/*
+ * Whether the BO kept by a suspended buffer can still be read by the
+ * hardware: either its picture has not left the open batch yet or the
+ * kernel still reports it busy
+ */
+static int ipvr__buffer_bo_busy(object_context_p obj_context, object_buffer_p obj_buffer)
+{
+    if (obj_buffer->fence && obj_context && obj_context->execbuf_ring &&
+        ved_context_execbuf_fence_pending(obj_context, obj_buffer->fence))
+        return 1;
+
+    return drm_ipvr_gem_bo_busy(obj_buffer->ipvr_bo);
+}
+
 static VAStatus ipvr__allocate_BO_buffer(ipvr_driver_data_p driver_data, object_context_p obj_context, object_buffer_p obj_buffer, int size, unsigned char *data, VABufferType type)
 {
     VAStatus vaStatus = VA_STATUS_SUCCESS;
@@ -982,6 +1012,23 @@ static VAStatus ipvr__allocate_BO_buffer(ipvr_driver_data_p driver_data, object_
         }
     }
 
+    /**
+     * a recycled buffer may still hold the BO of its previous use,
+     * ipvr__get_unused_buffer() only hands it out once it is idle,
+     * it is taken again when it is big enough
+     */
+    if (obj_buffer->ipvr_bo) {
+        if (obj_buffer->alloc_size < (unsigned int)size) {
+            drm_ipvr_gem_bo_unreference(obj_buffer->ipvr_bo);
+            obj_buffer->ipvr_bo = NULL;
+            obj_buffer->alloc_size = 0;
+        } else {
+            drv_debug_msg(VIDEO_DEBUG_GENERAL, "Reusing BO of buffer %08x, size %d alloc_size %d\n",
+                obj_buffer->base.id, size, obj_buffer->alloc_size);
+        }
+    }
+    obj_buffer->fence = 0;
+
     uint32_t cache_level = IPVR_CACHE_WRITEBACK;
     switch (obj_buffer->type) {
     case VAImageBufferType: /* Xserver side PutSurface, Image/subpicture buffer
@@ -998,7 +1045,7 @@ static VAStatus ipvr__allocate_BO_buffer(ipvr_driver_data_p driver_data, object_
      * call libdrm_ipvr to allocate from its internal cache or get new pages
      */
     if (!obj_buffer->ipvr_bo) {
-        size = (size + 0x7fff) & ~0x7fff;
+        size = IPVR_BO_BUFFER_SIZE(size);
         obj_buffer->ipvr_bo = drm_ipvr_gem_bo_alloc(driver_data->bufmgr, obj_context->ipvr_ctx,
             buffer_type_to_string(obj_buffer->type), size, 0, cache_level);
         if (obj_buffer->ipvr_bo) {
@@ -1013,9 +1060,126 @@ static VAStatus ipvr__allocate_BO_buffer(ipvr_driver_data_p driver_data, object_
     return vaStatus;
 }
 
+#ifdef HAVE_DRM_IPVR_USERPTR
+/*
+ * With IPVR_VIDEO_USERPTR_SLICE=1 the data passed to vaCreateBuffer for
+ * slice data is wrapped in a userptr BO and DMAed from directly. See
+ * "userptr_slice_data" for what the application agrees to.
+ * Returns 0 when the data can't be wrapped and has to be copied.
+ */
+static int ipvr__allocate_userptr_buffer(ipvr_driver_data_p driver_data, object_context_p obj_context,
+    object_buffer_p obj_buffer, unsigned int size, unsigned char *data)
+{
+    unsigned long page_size = getpagesize();
+    unsigned long bo_size = (size + page_size - 1) & ~(page_size - 1);
+
+    if (!obj_context || !size || ((uintptr_t)data & (page_size - 1)))
+        return 0;
+#ifdef WORKAROUND_DMA_OFF_BY_ONE
+    /* the byte after the end must be in a wrapped page too */
+    if (bo_size == size)
+        return 0;
+#endif
+
+    if (obj_buffer->ipvr_bo) {
+        drm_ipvr_gem_bo_unreference(obj_buffer->ipvr_bo);
+        obj_buffer->ipvr_bo = NULL;
+        obj_buffer->alloc_size = 0;
+    }
+
+    obj_buffer->ipvr_bo = drm_ipvr_gem_bo_alloc_userptr(driver_data->bufmgr, obj_context->ipvr_ctx,
+        buffer_type_to_string(obj_buffer->type), data, bo_size, 0, IPVR_CACHE_WRITEBACK);
+    if (!obj_buffer->ipvr_bo) {
+        drv_debug_msg(VIDEO_DEBUG_WARNING, "%s: userptr BO for %p failed, copying\n", __func__, data);
+        return 0;
+    }
+    obj_buffer->alloc_size = size;
+    obj_buffer->user_data = data;
+    obj_buffer->fence = 0;
+    return 1;
+}
+#endif
+
+/*
+ * Give "obj_buffer" the slice data described by "prime". Each dma-buf is
+ * imported once per context and found again by its GEM handle: the
+ * kernel returns the same handle for every fd of an already imported
+ * dma-buf, and the cache reference keeps that handle from being reused.
+ */
+static VAStatus ipvr__import_prime_buffer(ipvr_driver_data_p driver_data, object_context_p obj_context,
+    object_buffer_p obj_buffer, const IPVRPrimeSliceData *prime)
+{
+    struct ipvr_prime_cache_entry_s *entry = NULL, *lru = &obj_context->prime_cache[0];
+    uint32_t handle;
+    int i;
+
+    if (drmPrimeFDToHandle(driver_data->drm_fd, prime->fd, &handle)) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: import of fd %d failed: %s\n", __func__, prime->fd, strerror(errno));
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < IPVR_PRIME_CACHE_SIZE; i++) {
+        struct ipvr_prime_cache_entry_s *e = &obj_context->prime_cache[i];
+
+        if (e->bo && e->handle == handle) {
+            entry = e;
+            break;
+        }
+        if (lru->bo && (!e->bo || e->last_used < lru->last_used))
+            lru = e;
+    }
+
+    if (entry) {
+        obj_context->prime_cache_hits++;
+    } else {
+        /* the fd belongs to the application, leave its offset where it was */
+        off_t pos = lseek(prime->fd, 0, SEEK_CUR);
+        off_t dmabuf_size = lseek(prime->fd, 0, SEEK_END);
+        drm_ipvr_bo *bo;
+
+        if (pos >= 0)
+            lseek(prime->fd, pos, SEEK_SET);
+        if (dmabuf_size <= 0)
+            dmabuf_size = (off_t)prime->offset + prime->size;
+        bo = drm_ipvr_gem_bo_create_from_prime(driver_data->bufmgr, NULL,
+            "imported_slice_data", prime->fd, dmabuf_size);
+        if (!bo) {
+            drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: import of fd %d failed\n", __func__, prime->fd);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+        if (lru->bo)
+            drm_ipvr_gem_bo_unreference(lru->bo);
+        lru->bo = bo;
+        lru->handle = handle;
+        entry = lru;
+        obj_context->prime_cache_misses++;
+    }
+    entry->last_used = obj_context->frame_count;
+
+    if ((uint64_t)prime->offset + prime->size > entry->bo->size) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: 0x%x bytes at 0x%x exceed dma-buf size 0x%lx\n",
+            __func__, prime->size, prime->offset, entry->bo->size);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    if (obj_buffer->ipvr_bo)
+        drm_ipvr_gem_bo_unreference(obj_buffer->ipvr_bo);
+    drm_ipvr_gem_bo_reference(entry->bo);
+    obj_buffer->ipvr_bo = entry->bo;
+    obj_buffer->bo_offset = prime->offset;
+    obj_buffer->alloc_size = prime->size;
+    obj_buffer->imported = 1;
+    obj_buffer->fence = 0;
+    return VA_STATUS_SUCCESS;
+}
+
 static VAStatus ipvr__map_buffer(object_buffer_p obj_buffer)
 {
     int ret;
+    if (obj_buffer->user_data) {
+        obj_buffer->buffer_data = obj_buffer->user_data;
+        return VA_STATUS_SUCCESS;
+    }
     if (obj_buffer->ipvr_bo) {
         ret = drm_ipvr_gem_bo_map(obj_buffer->ipvr_bo, 1);
         if (ret) {
@@ -1024,7 +1188,7 @@ static VAStatus ipvr__map_buffer(object_buffer_p obj_buffer)
                 strerror(ret), ret);
             return VA_STATUS_ERROR_OPERATION_FAILED;
         }
-        obj_buffer->buffer_data = obj_buffer->ipvr_bo->virt;
+        obj_buffer->buffer_data = (unsigned char *)obj_buffer->ipvr_bo->virt + obj_buffer->bo_offset;
         return VA_STATUS_SUCCESS;
     }
     assert(obj_buffer->buffer_data);
@@ -1034,6 +1198,10 @@ static VAStatus ipvr__map_buffer(object_buffer_p obj_buffer)
 static VAStatus ipvr__unmap_buffer(object_buffer_p obj_buffer)
 {
     int ret;
+    if (obj_buffer->user_data) {
+        obj_buffer->buffer_data = NULL;
+        return VA_STATUS_SUCCESS;
+    }
     if (obj_buffer->ipvr_bo) {
         obj_buffer->buffer_data = NULL;
         ret = drm_ipvr_gem_bo_unmap(obj_buffer->ipvr_bo);
@@ -1069,15 +1237,159 @@ static void ipvr__destroy_buffer(ipvr_driver_data_p driver_data, object_buffer_p
     object_heap_free(&driver_data->buffer_heap, (object_base_p) obj_buffer);
 }
 
+/*
+ * Unused buffers are kept per buffer type and power-of-two class of their
+ * allocated size, each list in LRU order
+ */
+static int ipvr__buffer_size_class(unsigned int size)
+{
+    int size_class = 0;
+
+    size >>= 13;
+    while (size && size_class < IPVR_BUFFER_SIZE_CLASSES - 1) {
+        size >>= 1;
+        size_class++;
+    }
+    return size_class;
+}
+
+/*
+ * Bytes a buffer can take without a new allocation. alloc_size is not kept
+ * for every BO, e.g. one handed over by a decoder, so fall back to the BO.
+ */
+static unsigned int ipvr__buffer_capacity(object_buffer_p obj_buffer)
+{
+    if (obj_buffer->alloc_size == 0 && obj_buffer->ipvr_bo)
+        return obj_buffer->ipvr_bo->size;
+    return obj_buffer->alloc_size;
+}
+
+static void ipvr__unused_list_remove(object_context_p obj_context, object_buffer_p obj_buffer, int size_class)
+{
+    VABufferType type = obj_buffer->type;
+
+    *obj_buffer->pptr_prev_next = obj_buffer->ptr_next;
+    if (obj_buffer->ptr_next) {
+        obj_buffer->ptr_next->pptr_prev_next = obj_buffer->pptr_prev_next;
+    } else {
+        ASSERT(obj_context->buffers_unused_tail[type][size_class] == obj_buffer);
+        if (obj_buffer->pptr_prev_next == &(obj_context->buffers_unused[type][size_class]))
+            obj_context->buffers_unused_tail[type][size_class] = NULL;
+        else
+            obj_context->buffers_unused_tail[type][size_class] = (object_buffer_p)
+                ((char *)obj_buffer->pptr_prev_next - offsetof(struct object_buffer_s, ptr_next));
+    }
+    obj_context->buffers_unused_count[type]--;
+}
+
+/* How many size classes above the request an unused buffer may come from */
+#define IPVR_BUFFER_CLASS_SLACK 1
+
+/*
+ * Pick an unused buffer for "size" bytes: the least recently used one that
+ * fits and is idle from the smallest size classes. Buffers suspended in the
+ * picture being built are not considered. Without a fit the least recently
+ * used buffer of an older picture is recycled without its BO, NULL means a
+ * new buffer has to be allocated.
+ */
+static object_buffer_p ipvr__get_unused_buffer(object_context_p obj_context, VABufferType type, unsigned int size)
+{
+    object_buffer_p obj_buffer, lru = NULL;
+    int first_class, last_class;
+    int size_class, lru_class = 0;
+
+    /* classes hold allocated sizes, so look for the request as it would be allocated */
+    switch (type) {
+    case VABitPlaneBufferType:
+    case VASliceDataBufferType:
+    case VAResidualDataBufferType:
+    case VAImageBufferType:
+    case VASliceGroupMapBufferType:
+    case VAEncCodedBufferType:
+    case VAProtectedSliceDataBufferType:
+        first_class = ipvr__buffer_size_class(IPVR_BO_BUFFER_SIZE(size));
+        break;
+    default:
+        first_class = ipvr__buffer_size_class(size);
+        break;
+    }
+    last_class = first_class + IPVR_BUFFER_CLASS_SLACK;
+
+    if (last_class > IPVR_BUFFER_SIZE_CLASSES - 1)
+        last_class = IPVR_BUFFER_SIZE_CLASSES - 1;
+
+    for (size_class = first_class; size_class <= last_class; size_class++) {
+        obj_buffer = obj_context->buffers_unused[type][size_class];
+        for (; obj_buffer; obj_buffer = obj_buffer->ptr_next) {
+            /* a buffer without storage costs the same allocation as a new one */
+            if (ipvr__buffer_capacity(obj_buffer) < size &&
+                (obj_buffer->ipvr_bo || obj_buffer->buffer_data))
+                continue;
+            if (obj_buffer->ipvr_bo) {
+                /* this one and all after it belong to the current picture */
+                if (obj_buffer->last_used == obj_context->frame_count)
+                    break;
+                if (ipvr__buffer_bo_busy(obj_context, obj_buffer)) {
+                    obj_context->buffers_unused_stalls++;
+                    continue;
+                }
+            }
+            ipvr__unused_list_remove(obj_context, obj_buffer, size_class);
+            obj_context->buffers_unused_hits++;
+            return obj_buffer;
+        }
+    }
+
+    obj_context->buffers_unused_misses++;
+    for (size_class = 0; size_class < IPVR_BUFFER_SIZE_CLASSES; size_class++) {
+        obj_buffer = obj_context->buffers_unused[type][size_class];
+        if (obj_buffer && obj_buffer->last_used != obj_context->frame_count &&
+            (!lru || obj_buffer->last_used < lru->last_used)) {
+            lru = obj_buffer;
+            lru_class = size_class;
+        }
+    }
+    if (lru) {
+        ipvr__unused_list_remove(obj_context, lru, lru_class);
+        if (lru->ipvr_bo) {
+            drm_ipvr_gem_bo_unreference(lru->ipvr_bo);
+            lru->ipvr_bo = NULL;
+            lru->alloc_size = 0;
+        }
+    }
+    return lru;
+}
+
 void ipvr__suspend_buffer(ipvr_driver_data_p driver_data, object_buffer_p obj_buffer)
 {
     if (obj_buffer->ipvr_bo) {
-        /**
-         * unreference the bo
-         * libdrm_ipvr will manage the life cycle/LRU of it: free or cache it.
-         */
-        drm_ipvr_gem_bo_unreference(obj_buffer->ipvr_bo);
-        obj_buffer->ipvr_bo = NULL;
+        if (obj_buffer->buffer_data) {
+            ipvr__unmap_buffer(obj_buffer);
+        }
+
+        if (obj_buffer->context && !obj_buffer->export_refcount &&
+            !obj_buffer->user_data && !obj_buffer->imported &&
+            obj_buffer->type != VAProtectedSliceDataBufferType) {
+            /**
+             * keep the bo with the buffer so that the next vaCreateBuffer
+             * of this type doesn't go back to libdrm_ipvr, remember the
+             * picture it may have been queued with
+             */
+            object_context_p obj_context = obj_buffer->context;
+            obj_buffer->fence = obj_context->execbuf_ring ?
+                ved_context_execbuf_fence(obj_context) : 0;
+        } else {
+            /**
+             * unreference the bo
+             * libdrm_ipvr will manage the life cycle/LRU of it: free or cache it.
+             */
+            drm_ipvr_gem_bo_unreference(obj_buffer->ipvr_bo);
+            obj_buffer->ipvr_bo = NULL;
+            obj_buffer->user_data = NULL;
+            obj_buffer->imported = 0;
+            obj_buffer->bo_offset = 0;
+            obj_buffer->alloc_size = 0;
+        }
     }
 
     /**
@@ -1086,20 +1398,24 @@ void ipvr__suspend_buffer(ipvr_driver_data_p driver_data, object_buffer_p obj_bu
     if (obj_buffer->context) {
         VABufferType type = obj_buffer->type;
         object_context_p obj_context = obj_buffer->context;
+        int size_class = ipvr__buffer_size_class(ipvr__buffer_capacity(obj_buffer));
 
         /* Remove buffer from active list */
         *obj_buffer->pptr_prev_next = obj_buffer->ptr_next;
+        if (obj_buffer->ptr_next) {
+            obj_buffer->ptr_next->pptr_prev_next = obj_buffer->pptr_prev_next;
+        }
 
         /* Add buffer to tail of unused list */
         obj_buffer->ptr_next = NULL;
         obj_buffer->last_used = obj_context->frame_count;
-        if (obj_context->buffers_unused_tail[type]) {
-            obj_buffer->pptr_prev_next = &(obj_context->buffers_unused_tail[type]->ptr_next);
+        if (obj_context->buffers_unused_tail[type][size_class]) {
+            obj_buffer->pptr_prev_next = &(obj_context->buffers_unused_tail[type][size_class]->ptr_next);
         } else {
-            obj_buffer->pptr_prev_next = &(obj_context->buffers_unused[type]);
+            obj_buffer->pptr_prev_next = &(obj_context->buffers_unused[type][size_class]);
         }
         *obj_buffer->pptr_prev_next = obj_buffer;
-        obj_context->buffers_unused_tail[type] = obj_buffer;
+        obj_context->buffers_unused_tail[type][size_class] = obj_buffer;
         obj_context->buffers_unused_count[type]++;
 
         drv_debug_msg(VIDEO_DEBUG_GENERAL, "Adding buffer %08x type %s to unused list. unused count = %d\n", obj_buffer->base.id,
@@ -1114,10 +1430,18 @@ void ipvr__suspend_buffer(ipvr_driver_data_p driver_data, object_buffer_p obj_bu
 
 static void ipvr__destroy_context(ipvr_driver_data_p driver_data, object_context_p obj_context)
 {
-    int i;
+    int i, j;
 
     obj_context->format_vtable->destroyContext(obj_context);
 
+    if (obj_context->buffers_unused_hits + obj_context->buffers_unused_misses)
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s unused buffers: %u hits, %u misses, %u busy skipped\n",
+            __func__, obj_context->buffers_unused_hits, obj_context->buffers_unused_misses,
+            obj_context->buffers_unused_stalls);
+    if (obj_context->prime_cache_hits + obj_context->prime_cache_misses)
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s imported dma-bufs: %u hits, %u misses\n",
+            __func__, obj_context->prime_cache_hits, obj_context->prime_cache_misses);
+
     for (i = 0; i < IPVR_MAX_BUFFERTYPES; i++) {
         object_buffer_p obj_buffer;
         obj_buffer = obj_context->buffers_active[i];
@@ -1125,14 +1449,22 @@ static void ipvr__destroy_context(ipvr_driver_data_p driver_data, object_context
             drv_debug_msg(VIDEO_DEBUG_INIT, "%s: destroying active buffer %08x\n", __FUNCTION__, obj_buffer->base.id);
             ipvr__destroy_buffer(driver_data, obj_buffer);
         }
-        obj_buffer = obj_context->buffers_unused[i];
-        for (; obj_buffer; obj_buffer = obj_buffer->ptr_next) {
-            drv_debug_msg(VIDEO_DEBUG_INIT, "%s: destroying unused buffer %08x\n", __FUNCTION__, obj_buffer->base.id);
-            ipvr__destroy_buffer(driver_data, obj_buffer);
+        for (j = 0; j < IPVR_BUFFER_SIZE_CLASSES; j++) {
+            obj_buffer = obj_context->buffers_unused[i][j];
+            for (; obj_buffer; obj_buffer = obj_buffer->ptr_next) {
+                drv_debug_msg(VIDEO_DEBUG_INIT, "%s: destroying unused buffer %08x\n", __FUNCTION__, obj_buffer->base.id);
+                ipvr__destroy_buffer(driver_data, obj_buffer);
+            }
         }
         obj_context->buffers_unused_count[i] = 0;
     }
 
+    for (i = 0; i < IPVR_PRIME_CACHE_SIZE; i++) {
+        if (obj_context->prime_cache[i].bo)
+            drm_ipvr_gem_bo_unreference(obj_context->prime_cache[i].bo);
+        obj_context->prime_cache[i].bo = NULL;
+    }
+
     obj_context->context_id = -1;
     obj_context->config_id = -1;
     obj_context->picture_width = 0;
@@ -1186,8 +1518,22 @@ VAStatus ipvr__CreateBuffer(
     DEBUG_FUNC_ENTER
     VAStatus vaStatus = VA_STATUS_SUCCESS;
     int bufferID;
-    object_buffer_p obj_buffer = obj_context ? obj_context->buffers_unused[type] : NULL;
-    int unused_count = obj_context ? obj_context->buffers_unused_count[type] : 0;
+    object_buffer_p obj_buffer;
+    const IPVRPrimeSliceData *prime = NULL;
+    int unused_count;
+
+    if (type == IPVRPrimeSliceDataBufferType) {
+        /* slice data in a dma-buf, see ipvr__import_prime_buffer() */
+        if (!obj_context || !data || size != sizeof(IPVRPrimeSliceData) || num_elements != 1) {
+            DEBUG_FUNC_EXIT
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        }
+        prime = (const IPVRPrimeSliceData *)data;
+        type = VASliceDataBufferType;
+        size = prime->size;
+        data = NULL;
+    }
+    unused_count = obj_context ? obj_context->buffers_unused_count[type] : 0;
 
 
     /*
@@ -1195,11 +1541,13 @@ VAStatus ipvr__CreateBuffer(
      * For each buffer type, maintain
      *   - a LRU sorted list of unused buffers
      *   - a list of active buffers
+     *   - sorted by power-of-two size class, see ipvr__get_unused_buffer()
      * We only create a new buffer when
      *   - no unused buffers are available
      *   - the last unused buffer is still queued
      *   - the last unused buffer was used very recently and may still be fenced
      *      - used recently is defined as within the current frame_count (subject to tweaks)
+     * An unused buffer that doesn't fit is reused with a new BO.
      *
      * The buffer that is returned will be moved to the list of active buffers
      *   - vaDestroyBuffer and vaRenderPicture will move the active buffer back to the list of unused buffers
@@ -1207,22 +1555,13 @@ VAStatus ipvr__CreateBuffer(
     drv_debug_msg(VIDEO_DEBUG_GENERAL, "Requesting buffer creation, size=%d,elements=%d,type=%s\n", size, num_elements,
                              buffer_type_to_string(type));
 
+    /* Remove from unused list */
+    obj_buffer = obj_context ? ipvr__get_unused_buffer(obj_context, type, size * num_elements) : NULL;
     if (obj_buffer) {
         bufferID = obj_buffer->base.id;
         drv_debug_msg(VIDEO_DEBUG_GENERAL, "Reusing buffer %08x type %s from unused list. Unused = %d\n", bufferID,
                                  buffer_type_to_string(type), unused_count);
 
-        /* Remove from unused list */
-        obj_context->buffers_unused[type] = obj_buffer->ptr_next;
-        if (obj_context->buffers_unused[type]) {
-            obj_context->buffers_unused[type]->pptr_prev_next = &(obj_context->buffers_unused[type]);
-            ASSERT(obj_context->buffers_unused_tail[type] != obj_buffer);
-        } else {
-            ASSERT(obj_context->buffers_unused_tail[type] == obj_buffer);
-            obj_context->buffers_unused_tail[type] = 0;
-        }
-        obj_context->buffers_unused_count[type]--;
-
         object_heap_suspend_object((object_base_p)obj_buffer, 0); /* Make BufferID valid again */
         ASSERT(type == obj_buffer->type);
         ASSERT(obj_context == obj_buffer->context);
@@ -1260,7 +1599,15 @@ VAStatus ipvr__CreateBuffer(
     case VASliceGroupMapBufferType:
     case VAEncCodedBufferType:
     case VAProtectedSliceDataBufferType:
-        vaStatus = ipvr__allocate_BO_buffer(driver_data, obj_context,obj_buffer, size * num_elements, data, obj_buffer->type);
+        if (prime)
+            vaStatus = ipvr__import_prime_buffer(driver_data, obj_context, obj_buffer, prime);
+#ifdef HAVE_DRM_IPVR_USERPTR
+        else if (data && type == VASliceDataBufferType && driver_data->userptr_slice_data &&
+            ipvr__allocate_userptr_buffer(driver_data, obj_context, obj_buffer, size * num_elements, data))
+            drv_debug_msg(VIDEO_DEBUG_GENERAL, "Wrapped %ux%u bytes at %p.\n", size, num_elements, data);
+#endif
+        else
+            vaStatus = ipvr__allocate_BO_buffer(driver_data, obj_context,obj_buffer, size * num_elements, data, obj_buffer->type);
         drv_debug_msg(VIDEO_DEBUG_GENERAL, "succeeded with %p hnd %x offset 0x%lx.\n",
             obj_buffer->ipvr_bo, obj_buffer->ipvr_bo->handle, obj_buffer->ipvr_bo->offset);
         DEBUG_FAILURE;
@@ -1298,14 +1645,17 @@ VAStatus ipvr__CreateBuffer(
         obj_buffer->size = size;
         obj_buffer->max_num_elements = num_elements;
         obj_buffer->num_elements = num_elements;
-        if (data && (obj_buffer->type != VAProtectedSliceDataBufferType)) {
+        if (data && !obj_buffer->user_data && (obj_buffer->type != VAProtectedSliceDataBufferType)) {
             if (obj_buffer->ipvr_bo) {
                 assert(obj_buffer->ipvr_bo->size >= size);
             }
             vaStatus = ipvr__map_buffer(obj_buffer);
             if (VA_STATUS_SUCCESS == vaStatus) {
                 drv_debug_msg(VIDEO_DEBUG_GENERAL, "memcpy for %ux%u bytes.\n", size, num_elements);
-                memcpy(obj_buffer->buffer_data, data, size * num_elements);
+                if (obj_buffer->ipvr_bo)
+                    ipvr_wc_memcpy(obj_buffer->buffer_data, data, size * num_elements);
+                else
+                    memcpy(obj_buffer->buffer_data, data, size * num_elements);
 
                 ipvr__unmap_buffer(obj_buffer);
             }
@@ -1341,7 +1691,7 @@ VAStatus ipvr_CreateBuffer(
 
     CHECK_INVALID_PARAM(num_elements <= 0);
 
-    switch (type) {
+    switch ((int)type) {
     case VABitPlaneBufferType:
     case VASliceDataBufferType:
     case VAProtectedSliceDataBufferType:
@@ -1364,6 +1714,7 @@ VAStatus ipvr_CreateBuffer(
     case VAHuffmanTableBufferType:
     case VAProcPipelineParameterBufferType:
     case VAProcFilterParameterBufferType:
+    case IPVRPrimeSliceDataBufferType: /* driver private, see ipvr_drv_video.h */
         break;
 
     default:
@@ -1447,6 +1798,12 @@ VAStatus ipvr_MapBuffer(
 
     CHECK_INVALID_PARAM(pbuf == NULL);
 
+    if (obj_buffer->type == VAImageBufferType) {
+        object_surface_p obj_surface = SURFACE(obj_buffer->derived_surface);
+        if (obj_surface)
+            ipvr__flush_surface(driver_data, obj_surface);
+    }
+
     vaStatus = ipvr__map_buffer(obj_buffer);
     CHECK_VASTATUS();
 
@@ -1637,6 +1994,18 @@ VAStatus ipvr_EndPicture(
     return vaStatus;
 }
 
+/*
+ * Submit the pictures batched submission still holds back on the context
+ * decoding into obj_surface, before the CPU or another device looks at it.
+ */
+void ipvr__flush_surface(ipvr_driver_data_p driver_data, object_surface_p obj_surface)
+{
+    object_context_p obj_context = CONTEXT(obj_surface->context_id);
+
+    if (obj_context)
+        ved_context_flush_execbuf(obj_context);
+}
+
 VAStatus ipvr_SyncSurface(
     VADriverContextP ctx,
     VASurfaceID render_target
@@ -1652,6 +2021,8 @@ VAStatus ipvr_SyncSurface(
     obj_surface = SURFACE(render_target);
     CHECK_SURFACE(obj_surface);
 
+    ipvr__flush_surface(driver_data, obj_surface);
+
     vaStatus = ipvr_surface_sync(obj_surface->ipvr_surface);
 
     DEBUG_FAILURE;
@@ -1677,6 +2048,8 @@ VAStatus ipvr_QuerySurfaceStatus(
 
     CHECK_INVALID_PARAM(status == NULL);
 
+    ipvr__flush_surface(driver_data, obj_surface);
+
     vaStatus = ipvr_surface_query_status(obj_surface->ipvr_surface, &surface_status);
 
     *status = surface_status;
@@ -1797,6 +2170,8 @@ VAStatus ipvr_LockSurface(
     ipvr_surface_p ipvr_surface;
     CHECK_SURFACE(obj_surface);
 
+    ipvr__flush_surface(driver_data, obj_surface);
+
     ipvr_surface = obj_surface->ipvr_surface;
     if (buffer_name)
         drm_ipvr_gem_bo_flink(ipvr_surface->buf, buffer_name);
@@ -1936,7 +2311,12 @@ ipvr_AcquireBufferHandle(VADriverContextP ctx, VABufferID buf_id,
 
     if (!obj_buffer->ipvr_bo)
         return VA_STATUS_ERROR_INVALID_BUFFER;
-        
+
+    {
+        object_surface_p obj_surface = SURFACE(obj_buffer->derived_surface);
+        if (obj_surface)
+            ipvr__flush_surface(driver_data, obj_surface);
+    }
     drm_ipvr_gem_bo_wait(obj_buffer->ipvr_bo);
 
     if (obj_buffer->export_refcount > 0) {
@@ -2071,6 +2451,11 @@ VAStatus ipvr_Terminate(VADriverContextP ctx)
     }
     object_heap_destroy(&driver_data->config_heap);
 
+    if (driver_data->vp8_key_frame_probs) {
+        drm_ipvr_gem_bo_unreference(driver_data->vp8_key_frame_probs);
+        driver_data->vp8_key_frame_probs = NULL;
+    }
+
     drv_debug_msg(VIDEO_DEBUG_INIT, "vaTerminate: de-initialized DRM\n");
 
     ipvr__deinitDRM(ctx);
@@ -2216,6 +2601,22 @@ EXPORT VAStatus __vaDriverInit_0_32(VADriverContextP ctx)
         driver_data->profile2Format[VAProfileVP8Version0_3][VAEntrypointVLD] = &tng_VP8_vtable;
     }
 
+    /* IPVR_VIDEO_USERPTR_SLICE=1, see ipvr__allocate_userptr_buffer() */
+    driver_data->userptr_slice_data = 0;
+    {
+        char value[1024];
+
+        memset(value, 0, sizeof(value));
+        if (ipvr_parse_config("IPVR_VIDEO_USERPTR_SLICE", &value[0]) == 0 && atoi(value)) {
+#ifdef HAVE_DRM_IPVR_USERPTR
+            driver_data->userptr_slice_data = 1;
+            drv_debug_msg(VIDEO_DEBUG_INIT, "slice data is wrapped, not copied: it must stay unchanged until vaSyncSurface\n");
+#else
+            drv_debug_msg(VIDEO_DEBUG_WARNING, "IPVR_VIDEO_USERPTR_SLICE ignored, libdrm_ipvr has no userptr BOs\n");
+#endif
+        }
+    }
+
     result = object_heap_init(&driver_data->config_heap, sizeof(struct object_config_s), CONFIG_ID_OFFSET);
     if (result) {
         va_status = VA_STATUS_ERROR_OPERATION_FAILED;
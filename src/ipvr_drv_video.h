@@ -67,6 +67,30 @@
 #define IPVR_MAX_ENTRYPOINTS                     (VAEntrypointVideoProc + 1)
 #define IPVR_MAX_CONFIG_ATTRIBUTES               10
 #define IPVR_MAX_BUFFERTYPES                     VABufferTypeMax
+/*
+ * Driver private vaCreateBuffer type: "data" points to an IPVRPrimeSliceData,
+ * size is sizeof(IPVRPrimeSliceData) and num_elements 1. The buffer created
+ * is a VASliceDataBufferType reading the slice data from the dma-buf.
+ */
+#define IPVRPrimeSliceDataBufferType             ((VABufferType)0x1000)
+
+typedef struct _IPVRPrimeSliceData {
+    int fd;             /* PRIME fd, stays owned by the caller */
+    uint32_t offset;    /* start of the slice data in the dma-buf */
+    uint32_t size;      /* slice data bytes */
+} IPVRPrimeSliceData;
+
+/* dma-bufs imported for slice data, kept per context */
+#define IPVR_PRIME_CACHE_SIZE                    8
+
+struct ipvr_prime_cache_entry_s {
+    uint32_t handle; /* GEM handle of the dma-buf on the driver's DRM fd */
+    drm_ipvr_bo *bo;
+    uint32_t last_used;
+};
+
+/* Power-of-two size classes of the unused buffer lists, class 0 is < 8K, the last one >= 8M */
+#define IPVR_BUFFER_SIZE_CLASSES                 12
 
 /* Max # of command submission buffers */
 #define VED_MAX_CMDBUFS                10
@@ -122,8 +146,22 @@ struct ipvr_driver_data_s {
 
     drm_ipvr_bufmgr *bufmgr;
 
+    /* Compiled VP8 key frame B-mode probabilities, shared by all contexts */
+    drm_ipvr_bo *vp8_key_frame_probs;
+
     uint32_t ec_enabled;
 
+    /*
+     * Wrap page aligned slice data in userptr BOs instead of copying it
+     * (IPVR_VIDEO_USERPTR_SLICE=1, needs a libdrm_ipvr with
+     * drm_ipvr_gem_bo_alloc_userptr). This goes beyond what VA promises:
+     * the application must keep the memory passed to vaCreateBuffer
+     * mapped and unchanged until vaSyncSurface returns for the picture
+     * it was rendered into, and may free or reuse it only after that.
+     * The BO itself only takes the pages for DMA, it does not copy them.
+     */
+    int userptr_slice_data;
+
     /* VA_RT_FORMAT_PROTECTED is set to protected for Widevine case */
     int is_protected;
 };
@@ -142,6 +180,7 @@ struct object_config_s {
 struct ipvr_execbuffer_s;
 typedef struct ipvr_execbuffer_s ipvr_execbuffer_t;
 typedef ipvr_execbuffer_t *ipvr_execbuffer_p;
+struct ved_execbuf_ring_s;
 struct object_context_s {
     struct object_base_s base;
     VAContextID context_id;
@@ -163,11 +202,21 @@ struct object_context_s {
     unsigned char *format_data;
 
     ipvr_execbuffer_p execbuf;
+    /* Recycled CtrlAlloc/MTX-message BO pairs and command state backing "execbuf" */
+    struct ved_execbuf_ring_s *execbuf_ring;
 
     /* Buffers */
-    object_buffer_p buffers_unused[IPVR_MAX_BUFFERTYPES]; /* Linked lists (HEAD) of unused buffers for each buffer type */
-    int buffers_unused_count[IPVR_MAX_BUFFERTYPES]; /* Linked lists (HEAD) of unused buffers for each buffer type */
-    object_buffer_p buffers_unused_tail[IPVR_MAX_BUFFERTYPES]; /* Linked lists (TAIL) of unused buffers for each buffer type */
+    object_buffer_p buffers_unused[IPVR_MAX_BUFFERTYPES][IPVR_BUFFER_SIZE_CLASSES]; /* Linked lists (HEAD) of unused buffers for each buffer type and size class */
+    int buffers_unused_count[IPVR_MAX_BUFFERTYPES]; /* Number of unused buffers for each buffer type */
+    object_buffer_p buffers_unused_tail[IPVR_MAX_BUFFERTYPES][IPVR_BUFFER_SIZE_CLASSES]; /* Linked lists (TAIL) of unused buffers for each buffer type and size class */
+    /* Unused list statistics: reuses, new allocations, candidates skipped as busy */
+    uint32_t buffers_unused_hits;
+    uint32_t buffers_unused_misses;
+    uint32_t buffers_unused_stalls;
+
+    struct ipvr_prime_cache_entry_s prime_cache[IPVR_PRIME_CACHE_SIZE];
+    uint32_t prime_cache_hits;
+    uint32_t prime_cache_misses;
     object_buffer_p buffers_active[IPVR_MAX_BUFFERTYPES]; /* Linked lists of active buffers for each buffer type */
 
     object_buffer_p *buffer_list; /* for vaRenderPicture */
@@ -246,6 +295,11 @@ struct object_buffer_s {
     object_context_p context;
     VABufferType type;
     uint32_t last_used;
+    uint32_t fence; /* execbuf fence of the last picture that may use ipvr_bo */
+    unsigned char *user_data; /* application memory wrapped by ipvr_bo, not owned */
+    int imported; /* ipvr_bo is a dma-buf from the prime cache */
+    VASurfaceID derived_surface; /* surface behind a derived image buffer */
+    uint32_t bo_offset; /* start of the buffer in ipvr_bo */
     /* Export state */
     unsigned int export_refcount;
     VABufferInfo export_state;
@@ -373,6 +427,7 @@ inline static const char * buffer_type_to_string(int type)
 
 int ipvr_parse_config(char *env, char *env_value);
 void ipvr__destroy_surface(ipvr_driver_data_p driver_data, object_surface_p obj_surface);
+void ipvr__flush_surface(ipvr_driver_data_p driver_data, object_surface_p obj_surface);
 
 #define CHECK_SURFACE(obj_surface) \
     do { \
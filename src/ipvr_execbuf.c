@@ -38,7 +38,11 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "ipvr_def.h"
 #include "ipvr_drv_debug.h"
@@ -158,29 +162,181 @@ int ipvr_execbuffer_add_command(ipvr_execbuffer_p execbuf, int cmd, void *arg, s
     }
 }
 
-int ipvr_execbuffer_get(drm_ipvr_bufmgr *bufmgr, drm_ipvr_context *ctx,
-                 ipvr_execbuffer_p execbuf, const char *name,
-                 size_t buf_size)
+int ipvr_execbuffer_emit_block(ipvr_execbuffer_p execbuf,
+                 const unsigned char *block, uint32_t size)
+{
+    uint32_t *dst;
+
+    ASSERT((size & 0x3) == 0);
+    if (execbuf->cur_offset + size > execbuf->bo->size) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: %u bytes overflow execbuf at 0x%lx\n",
+            __func__, size, execbuf->cur_offset);
+        return -ENOSPC;
+    }
+    dst = (uint32_t *)(execbuf->vaddr + execbuf->cur_offset);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    /* the command stream is little endian, so the block is copied as is */
+    ipvr_wc_memcpy(dst, block, size);
+#else
+    {
+        uint32_t i;
+        for (i = 0; i < size; i += 4)
+            *dst++ = block[i] | (block[i+1] << 8) | (block[i+2] << 16) |
+                ((uint32_t)block[i+3] << 24);
+    }
+#endif
+    execbuf->cur_offset += size;
+    return 0;
+}
+
+/*
+ * Below this size the alignment head and tail dominate and the fence costs
+ * more than it saves
+ */
+#define IPVR_WC_COPY_MIN        256
+
+static void (*ipvr__wc_memcpy)(void *, const void *, size_t);
+static pthread_once_t ipvr__wc_memcpy_once = PTHREAD_ONCE_INIT;
+
+/* Scalar reference */
+static void ipvr__wc_memcpy_c(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+    ipvr_wc_flush();
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * The destination is brought to vector alignment with a memcpy of the head,
+ * whole vectors are streamed from unaligned loads, the tail is a memcpy
+ */
+__attribute__((target("sse2")))
+static void ipvr__wc_memcpy_sse2(void *dst, const void *src, size_t size)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+    for (; size >= 64; size -= 64, d += 64, s += 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)s);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)d, v0);
+        _mm_stream_si128((__m128i *)(d + 16), v1);
+        _mm_stream_si128((__m128i *)(d + 32), v2);
+        _mm_stream_si128((__m128i *)(d + 48), v3);
+    }
+    for (; size >= 16; size -= 16, d += 16, s += 16)
+        _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    memcpy(d, s, size);
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void ipvr__wc_memcpy_avx2(void *dst, const void *src, size_t size)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+    for (; size >= 128; size -= 128, d += 128, s += 128) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, v0);
+        _mm256_stream_si256((__m256i *)(d + 32), v1);
+        _mm256_stream_si256((__m256i *)(d + 64), v2);
+        _mm256_stream_si256((__m256i *)(d + 96), v3);
+    }
+    for (; size >= 32; size -= 32, d += 32, s += 32)
+        _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    memcpy(d, s, size);
+    _mm_sfence();
+}
+#endif
+
+static void ipvr__wc_memcpy_init(void)
+{
+    unsigned char src[1024 + 64], ref[1024 + 64], out[1024 + 64];
+    size_t i;
+
+    ipvr__wc_memcpy = ipvr__wc_memcpy_c;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        ipvr__wc_memcpy = ipvr__wc_memcpy_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        ipvr__wc_memcpy = ipvr__wc_memcpy_sse2;
+#endif
+    if (ipvr__wc_memcpy == ipvr__wc_memcpy_c)
+        return;
+
+    /* misaligned source and destination, odd length */
+    for (i = 0; i < sizeof(src); i++)
+        src[i] = (unsigned char)(i * 37 + 11);
+    memset(ref, 0, sizeof(ref));
+    memset(out, 0, sizeof(out));
+    memcpy(ref + 5, src + 3, 1024 + 41);
+    ipvr__wc_memcpy(out + 5, src + 3, 1024 + 41);
+    if (memcmp(ref, out, sizeof(ref))) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s streaming copy mismatch, using memcpy\n", __func__);
+        ipvr__wc_memcpy = ipvr__wc_memcpy_c;
+    }
+}
+
+void ipvr_wc_memcpy(void *dst, const void *src, size_t size)
+{
+    if (size < IPVR_WC_COPY_MIN) {
+        memcpy(dst, src, size);
+        return;
+    }
+    pthread_once(&ipvr__wc_memcpy_once, ipvr__wc_memcpy_init);
+    ipvr__wc_memcpy(dst, src, size);
+}
+
+int ipvr_execbuffer_attach(drm_ipvr_context *ctx, ipvr_execbuffer_p execbuf,
+                 drm_ipvr_bo *bo)
 {
-    int ret;
     ASSERT (!execbuf->valid);
+    ASSERT (bo->virt);
     execbuf->put = ipvr__execbuffer_put;
     execbuf->reloc = ipvr__execbuffer_reloc;
     execbuf->full = ipvr__execbuffer_full;
     execbuf->cur_offset = 0;
     execbuf->start_offset = 0;
-    execbuf->bo = drm_ipvr_gem_bo_alloc(bufmgr, ctx, name, buf_size, 0,
+    execbuf->bo = bo;
+    execbuf->ctx = ctx;
+    execbuf->vaddr = bo->virt;
+    return 0;
+}
+
+int ipvr_execbuffer_get(drm_ipvr_bufmgr *bufmgr, drm_ipvr_context *ctx,
+                 ipvr_execbuffer_p execbuf, const char *name,
+                 size_t buf_size)
+{
+    int ret;
+    drm_ipvr_bo *bo;
+    ASSERT (!execbuf->valid);
+    bo = drm_ipvr_gem_bo_alloc(bufmgr, ctx, name, buf_size, 0,
         IPVR_CACHE_WRITECOMBINE);
-    if (!execbuf->bo) {
+    if (!bo) {
         return -ENOMEM;
     }
-    ret = drm_ipvr_gem_bo_map(execbuf->bo, 1);
+    ret = drm_ipvr_gem_bo_map(bo, 1);
     if (ret) {
-        drm_ipvr_gem_bo_unreference(execbuf->bo);
+        drm_ipvr_gem_bo_unreference(bo);
         return ret;
     }
-    execbuf->ctx = ctx;
-    execbuf->vaddr = execbuf->bo->virt;
-    return 0;
+    return ipvr_execbuffer_attach(ctx, execbuf, bo);
 }
 
@@ -76,8 +76,30 @@ int ipvr_execbuffer_get(drm_ipvr_bufmgr *bufmgr, drm_ipvr_context *ctx,
                  ipvr_execbuffer_p execbuf, const char *name,
                  size_t buf_size);
 
+/*
+ * Copy "size" bytes of little-endian dwords into the command stream,
+ * checking the remaining space once for the whole block
+ */
+int ipvr_execbuffer_emit_block(ipvr_execbuffer_p execbuf,
+                 const unsigned char *block, uint32_t size);
+
+/*
+ * Bind an already allocated and mapped BO to "execbuf"
+ * The caller keeps ownership of "bo"
+ */
+int ipvr_execbuffer_attach(drm_ipvr_context *ctx, ipvr_execbuffer_p execbuf,
+                 drm_ipvr_bo *bo);
+
 void ipvr_execbuffer_put(ipvr_execbuffer_p execbuf);
 
 int ipvr_execbuffer_add_command(ipvr_execbuffer_p execbuf, int cmd, void *arg, size_t argsize);
 
+/*
+ * Copy host data into a write-combined BO mapping with non-temporal
+ * stores, fenced once at the end. Small copies are a plain memcpy and,
+ * like any other store to the mapping, are drained by ipvr_wc_flush()
+ * or the submission.
+ */
+void ipvr_wc_memcpy(void *dst, const void *src, size_t size);
+
 #endif /* _PSB_CMDBUF_H_ */
@@ -151,6 +151,7 @@ VAStatus ipvr_DeriveImage(
 
     CHECK_SURFACE(obj_surface);
     CHECK_INVALID_PARAM(image == NULL);
+    ipvr__flush_surface(driver_data, obj_surface);
     /* Can't derive image from reconstrued frame which is in tiled format */
     if (obj_surface->is_ref_surface == 1 || obj_surface->is_ref_surface == 2) {
         if (getenv("IPVR_VIDEO_IGNORE_TILED_FORMAT")) {
@@ -200,6 +201,7 @@ VAStatus ipvr_DeriveImage(
     obj_buffer->size = obj_surface->ipvr_surface->size;
     obj_buffer->max_num_elements = 0;
     obj_buffer->alloc_size = obj_buffer->size;
+    obj_buffer->derived_surface = surface;
 
     /* fill obj_image data structure */
     obj_image->image.image_id = imageID;
@@ -47,6 +47,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/time.h>
 
 #include "ipvr_def.h"
@@ -54,8 +55,24 @@
 
 #define MTXMSG_SIZE           (0x1000)
 #define CMD_SIZE              (0x1000)
-#define MTXMSG_MARGIN         (0x0040)
+/* room for a DECODE message and the back end pass that may follow it */
+#define MTXMSG_MARGIN         (0x0080)
 #define CMD_MARGIN            (0x0400)
+/* CtrlAlloc size limit when growing after split pictures */
+#define CMD_MAX_SIZE          (0x10000)
+
+/* default for IPVR_VIDEO_BATCH_TIMEOUT_MS */
+#define VED_BATCH_TIMEOUT_MS  (50)
+
+/* stream state registers tracked per context */
+#define VED_SHADOW_REGS       (32)
+/* marks a RENDEC destination address in a shadow register key */
+#define VED_SHADOW_RENDEC     (0x80000000)
+
+typedef struct ved_shadow_reg_s {
+    uint32_t key;
+    uint32_t val;
+} ved_shadow_reg_t, *ved_shadow_reg_p;
 
 typedef struct ved_execbuf_private_s {
     drm_ipvr_bo        *bo;
@@ -85,11 +102,68 @@ typedef struct ved_execbuf_private_s {
 
     unsigned long cur_offset;
     unsigned long start_offset;
+
+    /* ring slot the BOs were taken from */
+    struct ved_execbuf_slot_s *slot;
+    struct ved_execbuf_ring_s *ring;
+
+    /* pictures whose DECODE messages are chained in this execbuf */
+    int picture_count;
+    /* "decode_count" when the last of them was closed */
+    int picture_decode_count;
+    struct timeval batch_start;
+
+    /* unchanged state writes waiting for ved_execbuf_replay_state() */
+    int state_count;
+    ved_shadow_reg_t state[VED_SHADOW_REGS];
 } ved_execbuf_private_t, *ved_execbuf_private_p;
 
-static int ved_execbuffer_get(drm_ipvr_bufmgr *bufmgr, drm_ipvr_context *ctx,
-                 ipvr_execbuffer_p execbuf, const char *name,
-                 size_t buf_size);
+/*
+ * The CtrlAlloc BO and MTX-message BO of the context's execbuf. The slot
+ * outlives the BOs: each execbuf taken from it gets a fresh pair, see
+ * ved__execbuf_ring_acquire()
+ */
+typedef struct ved_execbuf_slot_s {
+    drm_ipvr_bo        *cmd_bo;
+    drm_ipvr_bo        *mtxmsg_bo;
+    /* both BOs stay mapped from allocation until the slot is freed */
+    int                mapped;
+    uint32_t           mtxmsg_len;
+} ved_execbuf_slot_t, *ved_execbuf_slot_p;
+
+struct ved_execbuf_ring_s {
+    /* command building state of the context's current execbuf */
+    ved_execbuf_private_t priv;
+    ved_execbuf_slot_t slot;
+    /* CtrlAlloc BO size for new execbufs, grows when pictures get split */
+    unsigned long      cmd_size;
+    /* pictures that did not fit into one execbuf */
+    int                split_count;
+    /* pictures ended so far and how many of them have been run */
+    uint32_t           picture_seq;
+    uint32_t           flushed_seq;
+
+    /*
+     * Batched submission: up to "batch_pictures" pictures are chained
+     * into one execbuf before it is run, unless it has been held for
+     * "batch_timeout_ms" (0 means no timeout)
+     */
+    int                batch_pictures;
+    int                batch_timeout_ms;
+
+    /*
+     * Last value this context programmed into each stream state
+     * register, see IPVR_VIDEO_SHADOW_REGS
+     */
+    int                shadow_enabled;
+    int                shadow_count;
+    ved_shadow_reg_t   shadow[VED_SHADOW_REGS];
+};
+typedef struct ved_execbuf_ring_s *ved_execbuf_ring_p;
+
+static int ved_execbuffer_get(drm_ipvr_context *ctx,
+                 ipvr_execbuffer_p execbuf, ved_execbuf_ring_p ring,
+                 ved_execbuf_slot_p slot);
 
 static int ved__execbuffer_ready(ipvr_execbuffer_p execbuf)
 {
@@ -119,6 +193,172 @@ ved__execbuffer_reset(ipvr_execbuffer_p execbuf)
     execbuf_priv->start_offset = 0;
 }*/
 
+/*
+ * Flushes the CPU writes of "slot" and hands its MTX messages to the kernel
+ */
+static int ved__execbuf_slot_exec(ved_execbuf_slot_p slot)
+{
+    int ret;
+
+    /*
+     * The BOs are write-combined, so draining the WC buffers is enough
+     * to make the CPU writes visible; the mappings themselves are kept
+     */
+    ipvr_wc_flush();
+
+    if (slot->mtxmsg_len == 0) {
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s empty cmd, skip exec\n", __func__);
+        return 0;
+    }
+    ret = drm_ipvr_gem_bo_exec(slot->mtxmsg_bo, 0, slot->mtxmsg_len, -1, NULL);
+    if (ret) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s submit execbuffer failed %d %s\n",
+            __func__, ret, strerror(ret));
+    }
+    return ret;
+}
+
+static int ved__execbuf_slot_map(ved_execbuf_slot_p slot)
+{
+    int ret;
+
+    if (slot->mapped)
+        return 0;
+    ret = drm_ipvr_gem_bo_map(slot->cmd_bo, 1);
+    if (ret)
+        return ret;
+    ret = drm_ipvr_gem_bo_map(slot->mtxmsg_bo, 1);
+    if (ret) {
+        drm_ipvr_gem_bo_unmap(slot->cmd_bo);
+        return ret;
+    }
+    slot->mapped = 1;
+    return 0;
+}
+
+static void ved__execbuf_slot_free(ved_execbuf_slot_p slot)
+{
+    if (slot->mapped) {
+        drm_ipvr_gem_bo_unmap(slot->mtxmsg_bo);
+        drm_ipvr_gem_bo_unmap(slot->cmd_bo);
+        slot->mapped = 0;
+    }
+    if (slot->mtxmsg_bo)
+        drm_ipvr_gem_bo_unreference(slot->mtxmsg_bo);
+    if (slot->cmd_bo)
+        drm_ipvr_gem_bo_unreference(slot->cmd_bo);
+    slot->mtxmsg_bo = NULL;
+    slot->cmd_bo = NULL;
+}
+
+static int ved__execbuf_slot_alloc(object_context_p obj_context, ved_execbuf_slot_p slot)
+{
+    drm_ipvr_bufmgr *bufmgr = obj_context->driver_data->bufmgr;
+
+    slot->mapped = 0;
+    slot->cmd_bo = drm_ipvr_gem_bo_alloc(bufmgr, obj_context->ipvr_ctx,
+        "VED-CtrlAlloc", obj_context->execbuf_ring->cmd_size, 0, IPVR_CACHE_WRITECOMBINE);
+    slot->mtxmsg_bo = drm_ipvr_gem_bo_alloc(bufmgr, obj_context->ipvr_ctx,
+        "VED-MtxMessage", MTXMSG_SIZE, 0, IPVR_CACHE_WRITECOMBINE);
+    if (!slot->cmd_bo || !slot->mtxmsg_bo || ved__execbuf_slot_map(slot)) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s failed to allocate execbuf slot\n", __func__);
+        ved__execbuf_slot_free(slot);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Give the context's slot fresh CtrlAlloc and MTX-message BOs
+ *
+ * libdrm_ipvr only drops the relocations of a BO, and the references
+ * they hold on their target BOs, when the BO itself is freed; a reused
+ * BO would have its new relocations appended to the stale ones. So the
+ * previous pair is released here, the kernel keeps it alive until the
+ * hardware is done with it.
+ */
+static ved_execbuf_slot_p ved__execbuf_ring_acquire(object_context_p obj_context)
+{
+    ved_execbuf_slot_p slot = &obj_context->execbuf_ring->slot;
+
+    ved__execbuf_slot_free(slot);
+    if (ved__execbuf_slot_alloc(obj_context, slot))
+        return NULL;
+    return slot;
+}
+
+int ved_context_create_execbuf_ring(object_context_p obj_context)
+{
+    ved_execbuf_ring_p ring;
+    char value[1024];
+
+    ring = calloc(1, sizeof(struct ved_execbuf_ring_s));
+    if (!ring)
+        return -ENOMEM;
+
+    ring->cmd_size = CMD_SIZE;
+    ring->batch_pictures = 1;
+    ring->batch_timeout_ms = VED_BATCH_TIMEOUT_MS;
+    memset(value, 0, sizeof(value));
+    if (ipvr_parse_config("IPVR_VIDEO_BATCH_PICTURES", &value[0]) == 0) {
+        ring->batch_pictures = atoi(value);
+        if (ring->batch_pictures < 1)
+            ring->batch_pictures = 1;
+        if (ring->batch_pictures > MAX_CMD_COUNT)
+            ring->batch_pictures = MAX_CMD_COUNT;
+    }
+    memset(value, 0, sizeof(value));
+    if (ipvr_parse_config("IPVR_VIDEO_BATCH_TIMEOUT_MS", &value[0]) == 0)
+        ring->batch_timeout_ms = atoi(value);
+    /* leave room for the whole batch */
+    while (ring->cmd_size < CMD_MAX_SIZE && ring->cmd_size < CMD_SIZE * ring->batch_pictures)
+        ring->cmd_size <<= 1;
+    if (ring->batch_pictures > 1)
+        drv_debug_msg(VIDEO_DEBUG_INIT, "%s batching up to %d pictures per submission, timeout %d ms\n",
+            __func__, ring->batch_pictures, ring->batch_timeout_ms);
+
+    memset(value, 0, sizeof(value));
+    if (ipvr_parse_config("IPVR_VIDEO_SHADOW_REGS", &value[0]) == 0)
+        ring->shadow_enabled = atoi(value);
+
+    obj_context->execbuf_ring = ring;
+    return 0;
+}
+
+void ved_context_destroy_execbuf_ring(object_context_p obj_context)
+{
+    ved_execbuf_ring_p ring = obj_context->execbuf_ring;
+
+    if (!ring)
+        return;
+    if (ring->split_count)
+        drv_debug_msg(VIDEO_DEBUG_WARNING, "%s %d pictures were split across execbufs, CtrlAlloc grew to 0x%lx\n",
+            __func__, ring->split_count, ring->cmd_size);
+    ved__execbuf_slot_free(&ring->slot);
+    free(ring);
+    obj_context->execbuf_ring = NULL;
+}
+
+static int ved__execbuf_batch_expired(object_context_p obj_context)
+{
+    ved_execbuf_ring_p ring = obj_context->execbuf_ring;
+    ipvr_execbuffer_p execbuf = obj_context->execbuf;
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+    struct timeval now;
+    long elapsed_ms;
+
+    if (execbuf_priv->picture_count >= ring->batch_pictures)
+        return 1;
+    if (ipvr_execbuffer_full(execbuf))
+        return 1;
+    if (ring->batch_timeout_ms <= 0)
+        return 0;
+    gettimeofday(&now, NULL);
+    elapsed_ms = (now.tv_sec - execbuf_priv->batch_start.tv_sec) * 1000 +
+        (now.tv_usec - execbuf_priv->batch_start.tv_usec) / 1000;
+    return elapsed_ms >= ring->batch_timeout_ms;
+}
+
 /*
  * Advances "obj_context" to the next execbuf
  *
@@ -126,17 +366,111 @@ ved__execbuffer_reset(ipvr_execbuffer_p execbuf)
  */
 int ved_context_get_execbuf(object_context_p obj_context)
 {
+    ved_execbuf_slot_p slot;
+    int ret;
+
+    if (obj_context->execbuf->valid) {
+        /* keep appending to an open batch unless it is overdue */
+        if (!ved__execbuf_batch_expired(obj_context))
+            return 0;
+        ret = ved_context_flush_execbuf(obj_context);
+        if (ret)
+            return ret;
+    }
+    slot = ved__execbuf_ring_acquire(obj_context);
+    if (!slot)
+        return -ENOMEM;
+
+    return ved_execbuffer_get(obj_context->ipvr_ctx, obj_context->execbuf,
+        obj_context->execbuf_ring, slot);
+}
+
+int ved_context_end_execbuf(object_context_p obj_context)
+{
+    ipvr_execbuffer_p execbuf = obj_context->execbuf;
+    ved_execbuf_private_p execbuf_priv;
+
+    if (!execbuf->valid)
+        return -EINVAL;
+    execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+    obj_context->execbuf_ring->picture_seq++;
+    if (execbuf_priv->picture_count++ == 0)
+        gettimeofday(&execbuf_priv->batch_start, NULL);
+    execbuf_priv->picture_decode_count = execbuf_priv->decode_count;
+
+    if (!ved__execbuf_batch_expired(obj_context)) {
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s deferring submission, %d pictures pending\n",
+            __func__, execbuf_priv->picture_count);
+        return 0;
+    }
+    return ved_context_flush_execbuf(obj_context);
+}
+
+int ved_context_reserve_execbuf(object_context_p obj_context)
+{
+    ved_execbuf_ring_p ring = obj_context->execbuf_ring;
+    ipvr_execbuffer_p execbuf = obj_context->execbuf;
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
     int ret;
 
-    if (obj_context->execbuf)
-        ASSERT(!obj_context->execbuf->valid);
+    /* the open batch was flushed for ved_context_execbuf_fence_submit() */
+    if (!execbuf->valid)
+        return ved_context_get_execbuf(obj_context);
 
-    ret = ved_execbuffer_get(obj_context->driver_data->bufmgr, obj_context->ipvr_ctx,
-        obj_context->execbuf, "VED-CtrlAlloc", CMD_SIZE);
-    
+    if (!ipvr_execbuffer_full(execbuf))
+        return 0;
+
+    if (execbuf_priv->decode_count > execbuf_priv->picture_decode_count) {
+        /* earlier slices of this picture are already in the execbuf */
+        ring->split_count++;
+        if (ring->cmd_size < CMD_MAX_SIZE)
+            ring->cmd_size <<= 1;
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s picture split across execbufs (%d so far), CtrlAlloc now 0x%lx\n",
+            __func__, ring->split_count, ring->cmd_size);
+    }
+    ret = ved_context_flush_execbuf(obj_context);
+    if (ret)
+        return ret;
+    return ved_context_get_execbuf(obj_context);
+}
+
+int ved_context_flush_execbuf(object_context_p obj_context)
+{
+    ipvr_execbuffer_p execbuf = obj_context->execbuf;
+    int ret;
+
+    if (!execbuf || !execbuf->valid)
+        return 0;
+    ret = ipvr_execbuffer_run(execbuf);
+    ipvr_execbuffer_put(execbuf);
+    obj_context->execbuf_ring->flushed_seq = obj_context->execbuf_ring->picture_seq;
     return ret;
 }
 
+uint32_t ved_context_execbuf_fence(object_context_p obj_context)
+{
+    return obj_context->execbuf_ring->picture_seq + 1;
+}
+
+int ved_context_execbuf_fence_pending(object_context_p obj_context, uint32_t fence)
+{
+    ved_execbuf_ring_p ring = obj_context->execbuf_ring;
+
+    return (int32_t)(fence - ring->flushed_seq) > 0;
+}
+
+int ved_context_execbuf_fence_submit(object_context_p obj_context, uint32_t fence)
+{
+    ved_execbuf_ring_p ring = obj_context->execbuf_ring;
+
+    /* the picture being built can't be submitted yet */
+    if ((int32_t)(fence - ring->picture_seq) > 0)
+        return -EINVAL;
+    if ((int32_t)(fence - ring->flushed_seq) <= 0)
+        return 0;
+    /* the picture still sits in the open batch */
+    return ved_context_flush_execbuf(obj_context);
+}
 
 static void *
 ved__execbuf_alloc_space_from_mtxmsg(ipvr_execbuffer_p execbuf,
@@ -163,8 +497,26 @@ int ved_context_submit_host_be_opp(object_context_p obj_context,
                                   uint32_t chroma_offset_a,
                                   uint32_t chroma_offset_b)
 {
-    return -EINVAL;
+    struct ved_be_opp_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.msg_type = VA_MSGID_HOST_BE_OPP_MFLD;
+    arg.field_type = field_type;
+    arg.flags = FW_VA_RENDER_IS_LAST_SLICE | FW_DEVA_DEBLOCK_ENABLE;
+    arg.operating_mode = obj_context->operating_mode;
+    arg.picture_width_mb = picture_widht_mb;
+    arg.frame_height_mb = frame_height_mb;
+    arg.rotation_flags = rotation_flags;
+    arg.ext_stride_a = ext_stride_a;
+    arg.buf_a = buf_a;
+    arg.chroma_offset_a = chroma_offset_a;
+    arg.buf_b = buf_b;
+    arg.chroma_offset_b = chroma_offset_b;
+    arg.mb_param_buf = buf_c;
+
+    return ipvr_execbuffer_add_command(obj_context->execbuf, VED_COMMAND_HOST_BE_OPP, &arg, sizeof(arg));
 }
+
 int ved_context_submit_hw_deblock(object_context_p obj_context,
                                   drm_ipvr_bo *buf_a,
                                   drm_ipvr_bo *buf_b,
@@ -178,7 +530,24 @@ int ved_context_submit_hw_deblock(object_context_p obj_context,
                                   uint32_t chroma_offset_b,
                                   uint32_t is_oold)
 {
-    return -EINVAL;
+    struct ved_be_opp_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.msg_type = is_oold ? VA_MSGID_OOLD_MFLD : VA_MSGID_DEBLOCK_MFLD;
+    arg.field_type = field_type;
+    arg.flags = FW_VA_RENDER_IS_LAST_SLICE | FW_DEVA_DEBLOCK_ENABLE;
+    arg.operating_mode = obj_context->operating_mode;
+    arg.picture_width_mb = picture_widht_mb;
+    arg.frame_height_mb = frame_height_mb;
+    arg.rotation_flags = rotation_flags;
+    arg.ext_stride_a = ext_stride_a;
+    arg.buf_a = buf_a;
+    arg.chroma_offset_a = chroma_offset_a;
+    arg.buf_b = buf_b;
+    arg.chroma_offset_b = chroma_offset_b;
+    arg.mb_param_buf = colocate_buffer;
+
+    return ipvr_execbuffer_add_command(obj_context->execbuf, VED_COMMAND_DEBLOCK, &arg, sizeof(arg));
 }
 
 static int
@@ -252,6 +621,91 @@ ved__add_decode_command(ipvr_execbuffer_p execbuf, struct ved_fe_decode_arg *arg
 }
 
 
+/*
+ * Points the MTX message dword at "msg_offset" + "field_offset" to
+ * "offset" bytes into "bo"
+ */
+static int
+ved__mtxmsg_reloc(ipvr_execbuffer_p execbuf, unsigned long msg_offset, unsigned long field_offset,
+                  drm_ipvr_bo *bo, uint32_t offset)
+{
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+    uint32_t *dest = (uint32_t *)((uint8_t *)execbuf_priv->bo->virt + msg_offset + field_offset);
+    int ret;
+
+    ret = drm_ipvr_gem_bo_emit_reloc(execbuf_priv->bo, msg_offset + field_offset, bo, offset, 0);
+    if (ret) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s::%d emit_reloc failed\n", __func__, __LINE__);
+        return ret;
+    }
+    *dest = bo->offset + offset;
+    return 0;
+}
+
+static int
+ved__add_be_opp_command(ipvr_execbuffer_p execbuf, struct ved_be_opp_arg *arg)
+{
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+    unsigned long msg_offset = execbuf_priv->cur_offset;
+    FW_VA_DEBLOCK_MSG *msg;
+    int ret;
+
+    if (!arg->buf_a || !arg->buf_b)
+        return -EINVAL;
+    /* the pass must follow the DECODE of its picture in this execbuf */
+    if (execbuf_priv->decode_count <= execbuf_priv->picture_decode_count) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: no picture decoded in this execbuf\n", __func__);
+        return -EINVAL;
+    }
+    if (msg_offset + FW_DEVA_DEBLOCK_SIZE > MTXMSG_SIZE)
+        return -ENOSPC;
+
+    msg = (FW_VA_DEBLOCK_MSG *)ved__execbuf_alloc_space_from_mtxmsg(execbuf, FW_DEVA_DEBLOCK_SIZE);
+    memset(msg, 0, FW_DEVA_DEBLOCK_SIZE);
+
+    msg->header.bits.msg_size = FW_DEVA_DEBLOCK_SIZE;
+    msg->header.bits.msg_type = arg->msg_type;
+    msg->flags.bits.flags = arg->flags | FW_VA_RENDER_HOST_INT;
+    msg->flags.bits.slice_type = arg->field_type;
+    msg->operating_mode = arg->operating_mode;
+    msg->mmu_context.bits.context = (uint8_t)(execbuf->ctx->ctx_id & 0xff);
+    msg->mmu_context.bits.mmu_ptd = 0;
+    msg->pic_size.bits.frame_height_mb = (uint16_t)arg->frame_height_mb;
+    msg->pic_size.bits.pic_width_mb = (uint16_t)arg->picture_width_mb;
+    msg->ext_stride_a = arg->ext_stride_a;
+    msg->rotation_flags = arg->rotation_flags;
+
+    ret = ved__mtxmsg_reloc(execbuf, msg_offset, offsetof(FW_VA_DEBLOCK_MSG, address_a0), arg->buf_a, 0);
+    if (!ret)
+        ret = ved__mtxmsg_reloc(execbuf, msg_offset, offsetof(FW_VA_DEBLOCK_MSG, address_a1),
+            arg->buf_a, arg->chroma_offset_a);
+    if (!ret)
+        ret = ved__mtxmsg_reloc(execbuf, msg_offset, offsetof(FW_VA_DEBLOCK_MSG, address_b0), arg->buf_b, 0);
+    if (!ret)
+        ret = ved__mtxmsg_reloc(execbuf, msg_offset, offsetof(FW_VA_DEBLOCK_MSG, address_b1),
+            arg->buf_b, arg->chroma_offset_b);
+    if (!ret && arg->mb_param_buf)
+        ret = ved__mtxmsg_reloc(execbuf, msg_offset, offsetof(FW_VA_DEBLOCK_MSG, mb_param_address),
+            arg->mb_param_buf, 0);
+    if (ret) {
+        /* give the space back, a half filled message must not be submitted */
+        execbuf_priv->cur_offset = msg_offset;
+        return ret;
+    }
+
+    /* this message now completes the batch, see ved__add_decode_command() */
+    if (execbuf_priv->last_decode_flags) {
+        *execbuf_priv->last_decode_flags &= ~FW_VA_RENDER_HOST_INT;
+        *execbuf_priv->last_decode_flags |= FW_VA_RENDER_NO_RESPONCE_MSG;
+    }
+    execbuf_priv->last_decode_flags = (uint16_t *)&msg->flags;
+    execbuf_priv->host_be_opp_count++;
+
+    drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s: msg type 0x%x for %dx%d MBs after decode %d\n", __func__,
+        arg->msg_type, arg->picture_width_mb, arg->frame_height_mb, execbuf_priv->decode_count);
+    return 0;
+}
+
 static int
 ved__execbuffer_add_command(ipvr_execbuffer_p execbuf,
         int cmd, void *arg, size_t arg_size)
@@ -263,6 +717,11 @@ ved__execbuffer_add_command(ipvr_execbuffer_p execbuf,
         }
         return ved__add_decode_command(execbuf, (struct ved_fe_decode_arg*)arg);
     case VED_COMMAND_HOST_BE_OPP:
+    case VED_COMMAND_DEBLOCK:
+        if (arg_size < sizeof(struct ved_be_opp_arg)) {
+            return -EINVAL;
+        }
+        return ved__add_be_opp_command(execbuf, (struct ved_be_opp_arg*)arg);
     default:
         return -EINVAL;
     }
@@ -352,12 +811,13 @@ void ved_execbuf_dma_write_bitstream(ipvr_execbuffer_p execbuf,
  */
 void ved_execbuf_dma_write_bitstream_chained(ipvr_execbuffer_p execbuf,
         drm_ipvr_bo *bitstream_buf,
+        uint32_t buffer_offset,
         uint32_t size_in_bytes)
 {
     ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
     EMIT_DWORD(execbuf, CMD_BITSTREAM_DMA | size_in_bytes);
     EMIT_RELOC(execbuf, *(execbuf->vaddr + execbuf->cur_offset),
-        0, bitstream_buf, 0);
+        buffer_offset, bitstream_buf, 0);
 
     *(execbuf_priv->cmd_bitstream_size) += size_in_bytes;
 }
@@ -429,16 +889,12 @@ void ved_execbuf_rendec_start(ipvr_execbuffer_p execbuf, uint32_t dest_address)
     execbuf->cur_offset += 4;
 }
 
-void ved_execbuf_rendec_write_block(ipvr_execbuffer_p execbuf,
+int ved_execbuf_rendec_write_block(ipvr_execbuffer_p execbuf,
                                    unsigned char *block,
                                    uint32_t size)
 {
     ASSERT((size & 0x3) == 0);
-    unsigned int i;
-    for (i = 0; i < size; i += 4) {
-        uint32_t val = block[i] | (block[i+1] << 8) | (block[i+2] << 16) | (block[i+3] << 24);
-        ved_execbuf_rendec_write(execbuf, val);
-    }
+    return ipvr_execbuffer_emit_block(execbuf, block, size);
 }
 
 void ved_execbuf_rendec_write_address(ipvr_execbuffer_p execbuf,
@@ -496,19 +952,116 @@ void ved_execbuf_skip_end_block(ipvr_execbuffer_p execbuf)
     execbuf_priv->skip_block_start = NULL;
 }
 
+/*
+ * Returns 1 if "val" is what this context last programmed into "key",
+ * otherwise records it and returns 0
+ */
+static int ved__execbuf_shadow_unchanged(ipvr_execbuffer_p execbuf, uint32_t key, uint32_t val)
+{
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+    ved_execbuf_ring_p ring = execbuf_priv->ring;
+    int i;
+
+    if (!ring->shadow_enabled)
+        return 0;
+    for (i = 0; i < ring->shadow_count; i++) {
+        if (ring->shadow[i].key == key) {
+            if (ring->shadow[i].val == val)
+                return execbuf_priv->state_count < VED_SHADOW_REGS;
+            ring->shadow[i].val = val;
+            return 0;
+        }
+    }
+    if (ring->shadow_count < VED_SHADOW_REGS) {
+        ring->shadow[ring->shadow_count].key = key;
+        ring->shadow[ring->shadow_count].val = val;
+        ring->shadow_count++;
+    }
+    return 0;
+}
+
+int ved_execbuf_state_shadowed(ipvr_execbuffer_p execbuf)
+{
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+
+    return execbuf_priv->ring->shadow_enabled;
+}
+
+static void ved__execbuf_defer_state(ipvr_execbuffer_p execbuf, uint32_t key, uint32_t val)
+{
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+
+    execbuf_priv->state[execbuf_priv->state_count].key = key;
+    execbuf_priv->state[execbuf_priv->state_count].val = val;
+    execbuf_priv->state_count++;
+}
+
+void ved_execbuf_reg_set_state(ipvr_execbuffer_p execbuf, uint32_t reg, uint32_t val)
+{
+    if (ved__execbuf_shadow_unchanged(execbuf, reg, val)) {
+        ved__execbuf_defer_state(execbuf, reg, val);
+        return;
+    }
+    ved_execbuf_reg_start_block(execbuf, 0);
+    ved_execbuf_reg_set(execbuf, reg, val);
+    ved_execbuf_reg_end_block(execbuf);
+}
+
+void ved_execbuf_rendec_write_state(ipvr_execbuffer_p execbuf, uint32_t dest_address, uint32_t val)
+{
+    if (ved__execbuf_shadow_unchanged(execbuf, dest_address | VED_SHADOW_RENDEC, val)) {
+        ved__execbuf_defer_state(execbuf, dest_address | VED_SHADOW_RENDEC, val);
+        return;
+    }
+    ved_execbuf_rendec_start(execbuf, dest_address);
+    ved_execbuf_rendec_write(execbuf, val);
+    ved_execbuf_rendec_end(execbuf);
+}
+
+/*
+ * Emit the deferred unchanged state so that the firmware only executes
+ * it when another context has used the hardware in between
+ */
+void ved_execbuf_replay_state(ipvr_execbuffer_p execbuf)
+{
+    ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
+    ved_shadow_reg_p state = execbuf_priv->state;
+    int i, reg_block = 0;
+
+    if (!execbuf_priv->state_count)
+        return;
+
+    ved_execbuf_skip_start_block(execbuf, SKIP_ON_CONTEXT_SWITCH);
+    for (i = 0; i < execbuf_priv->state_count; i++) {
+        if (state[i].key & VED_SHADOW_RENDEC)
+            continue;
+        if (!reg_block) {
+            ved_execbuf_reg_start_block(execbuf, 0);
+            reg_block = 1;
+        }
+        ved_execbuf_reg_set(execbuf, state[i].key, state[i].val);
+    }
+    if (reg_block)
+        ved_execbuf_reg_end_block(execbuf);
+    for (i = 0; i < execbuf_priv->state_count; i++) {
+        if (!(state[i].key & VED_SHADOW_RENDEC))
+            continue;
+        ved_execbuf_rendec_start(execbuf, state[i].key & ~VED_SHADOW_RENDEC);
+        ved_execbuf_rendec_write(execbuf, state[i].val);
+        ved_execbuf_rendec_end(execbuf);
+    }
+    ved_execbuf_skip_end_block(execbuf);
+    execbuf_priv->state_count = 0;
+}
 
 static void
 ved__execbuffer_put(ipvr_execbuffer_p execbuf)
 {
     ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
-    if (execbuf_priv && execbuf_priv->bo) {
-        drm_ipvr_gem_bo_unmap(execbuf_priv->bo);
-        drm_ipvr_gem_bo_unreference(execbuf_priv->bo);
+    /* the BOs stay in their ring slot until it is next acquired */
+    if (execbuf_priv) {
         execbuf_priv->bo = NULL;
-    }
-    if (execbuf->bo) {
-        drm_ipvr_gem_bo_unmap(execbuf->bo);
-        drm_ipvr_gem_bo_unreference(execbuf->bo);
+        execbuf_priv->slot = NULL;
     }
     execbuf->bo = NULL;
     execbuf->put = NULL;
@@ -528,8 +1081,8 @@ ved__execbuffer_full(ipvr_execbuffer_p execbuf)
 {
     ved_execbuf_private_p execbuf_priv = (ved_execbuf_private_p)execbuf->priv;
     return (execbuf_priv->decode_count >= MAX_CMD_COUNT) ||
-            (MTXMSG_SIZE - execbuf_priv->cur_offset < MTXMSG_MARGIN) ||
-            (CMD_SIZE - execbuf->cur_offset < CMD_MARGIN);
+            (execbuf_priv->cur_offset + MTXMSG_MARGIN > MTXMSG_SIZE) ||
+            (execbuf->cur_offset + CMD_MARGIN > execbuf->bo->size);
 }
 
 static int
@@ -590,51 +1143,29 @@ ved__execbuffer_run(ipvr_execbuffer_p execbuf)
         }
     }
 
-    /**
-     * make sure that these BOs' cache are flushed
-     */
-    drm_ipvr_gem_bo_unmap(mtxmsg_bo);
-    drm_ipvr_gem_bo_unmap(execbuf->bo);
+    execbuf_priv->slot->mtxmsg_len = mtxmsg_len;
+    ret = ved__execbuf_slot_exec(execbuf_priv->slot);
+    if (ret)
+        execbuf_priv->ring->shadow_count = 0;
 
-    if (mtxmsg_len == 0) {
-        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s empty cmd, skip exec\n", __func__);
-        return 0;
-    }
-    ret = drm_ipvr_gem_bo_exec(mtxmsg_bo, 0, mtxmsg_len, -1, NULL);
-    if (ret) {
-        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s submit execbuffer failed %d %s\n",
-            __func__, ret, strerror(ret));
-    }
-    
     drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s: success\n", __func__);
     return ret;
 }
 
-static int ved_execbuffer_get(drm_ipvr_bufmgr *bufmgr, drm_ipvr_context *ctx,
-                 ipvr_execbuffer_p execbuf, const char *name,
-                 size_t buf_size)
+static int ved_execbuffer_get(drm_ipvr_context *ctx,
+                 ipvr_execbuffer_p execbuf, ved_execbuf_ring_p ring,
+                 ved_execbuf_slot_p slot)
 {
+    ved_execbuf_private_p execbuf_priv = &ring->priv;
     int ret;
-    ret = ipvr_execbuffer_get(bufmgr, ctx, execbuf, name, buf_size);
-    if (ret) {
-        return -ENOMEM;
-    }
-    static ved_execbuf_private_t execbuf_priv;
-    memset(&execbuf_priv, 0, sizeof(execbuf_priv));
-    execbuf_priv.bo = drm_ipvr_gem_bo_alloc(bufmgr, ctx, "VED-MtxMessage",
-        MTXMSG_SIZE, 0, IPVR_CACHE_WRITECOMBINE);
-    if (!execbuf_priv.bo) {
-        ipvr_execbuffer_put(execbuf);
-        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s failed to allocate CMD buf\n", __func__);
-        return -ENOMEM;
-    }
-    ret = drm_ipvr_gem_bo_map(execbuf_priv.bo, 1);
+    ret = ipvr_execbuffer_attach(ctx, execbuf, slot->cmd_bo);
     if (ret) {
-        drm_ipvr_gem_bo_unreference(execbuf_priv.bo);
-        ipvr_execbuffer_put(execbuf);
-        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s failed to map CMD buf\n", __func__);
         return -ENOMEM;
     }
+    memset(execbuf_priv, 0, sizeof(*execbuf_priv));
+    execbuf_priv->bo = slot->mtxmsg_bo;
+    execbuf_priv->slot = slot;
+    execbuf_priv->ring = ring;
     /**
      * override the callbacks of execbuffer
      */
@@ -643,9 +1174,9 @@ static int ved_execbuffer_get(drm_ipvr_bufmgr *bufmgr, drm_ipvr_context *ctx,
     execbuf->full = ved__execbuffer_full;
     execbuf->ready = ved__execbuffer_ready;
     execbuf->add_command = ved__execbuffer_add_command;
-    execbuf->priv = &execbuf_priv;
+    execbuf->priv = execbuf_priv;
     drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s got cmd %p, mtxmsg %p, ctx %u\n",
-        __func__, execbuf->vaddr, execbuf_priv.bo->virt, execbuf->ctx->ctx_id);
+        __func__, execbuf->vaddr, execbuf_priv->bo->virt, execbuf->ctx->ctx_id);
     execbuf->valid = 1;
     return 0;
 }
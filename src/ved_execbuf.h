@@ -44,6 +44,7 @@
 enum {
     VED_COMMAND_FE_DECODE    = 0,
     VED_COMMAND_HOST_BE_OPP = 1,
+    VED_COMMAND_DEBLOCK     = 2,
 };
 
 struct ved_fe_decode_arg
@@ -53,8 +54,67 @@ struct ved_fe_decode_arg
     uint32_t operating_mode;
 };
 
+/*
+ * Back end pass over a picture decoded in the same execbuf, sent as an
+ * FW_VA_DEBLOCK_MSG right after its DECODE message
+ */
+struct ved_be_opp_arg
+{
+    uint8_t msg_type;
+    uint8_t field_type;
+    uint16_t flags;
+    uint32_t operating_mode;
+    uint32_t picture_width_mb;
+    uint32_t frame_height_mb;
+    uint32_t rotation_flags;
+    uint32_t ext_stride_a;
+    /* the decoded picture */
+    drm_ipvr_bo *buf_a;
+    uint32_t chroma_offset_a;
+    /* the concealment reference or the deblocked output */
+    drm_ipvr_bo *buf_b;
+    uint32_t chroma_offset_b;
+    /* macroblock parameters, may be NULL */
+    drm_ipvr_bo *mb_param_buf;
+};
+
 int ved_context_get_execbuf(object_context_p obj_context);
 
+/*
+ * Closes the current picture in "obj_context"'s execbuf
+ *
+ * The execbuf is submitted right away unless IPVR_VIDEO_BATCH_PICTURES
+ * allows more pictures to be chained into it; in that case it is kept
+ * open until the batch is full, times out or is flushed.
+ *
+ * Returns 0 on success
+ */
+int ved_context_end_execbuf(object_context_p obj_context);
+
+/*
+ * Makes sure "obj_context"'s execbuf has room for another slice,
+ * submitting it first if it is full. A picture that gets split this
+ * way is counted and makes later CtrlAlloc buffers bigger.
+ *
+ * Returns 0 on success
+ */
+int ved_context_reserve_execbuf(object_context_p obj_context);
+
+/*
+ * Create/destroy the per-context ring of CtrlAlloc and MTX-message BOs
+ * that ved_context_get_execbuf() takes its execbufs from
+ */
+int ved_context_create_execbuf_ring(object_context_p obj_context);
+
+void ved_context_destroy_execbuf_ring(object_context_p obj_context);
+
+/*
+ * Queue a back end pass (error concealment or deblocking) over the picture
+ * just decoded in "obj_context"'s execbuf, so that it runs in the same
+ * submission as the decode
+ *
+ * Returns 0 on success
+ */
 int ved_context_submit_host_be_opp(object_context_p obj_context,
                                   drm_ipvr_bo *buf_a,
                                   drm_ipvr_bo *buf_b,
@@ -89,11 +149,28 @@ int ved_context_submit_hw_deblock(object_context_p obj_context,
 int ved_context_submit_execbuf(object_context_p obj_context, ipvr_execbuffer_p mtxmsg);
 
 /*
- * Flushes the pending execbuf
+ * Flushes the pending execbuf, submitting pictures held back by
+ * batched submission
  *
  * Return 0 on success
  */
-int ved_context_flush_execbuf(object_context_p obj_context, ipvr_execbuffer_p mtxmsg);
+int ved_context_flush_execbuf(object_context_p obj_context);
+
+/*
+ * Fences let a decoder reuse a BO written by the CPU once the picture
+ * that last referenced it has reached the kernel; BO busy tracking
+ * covers it from then on.
+ *
+ * ved_context_execbuf_fence returns the fence of the picture currently
+ * being built, ved_context_execbuf_fence_pending returns non-zero while
+ * picture "fence" has not been handed to the kernel, and
+ * ved_context_execbuf_fence_submit flushes the batch holding it.
+ */
+uint32_t ved_context_execbuf_fence(object_context_p obj_context);
+
+int ved_context_execbuf_fence_pending(object_context_p obj_context, uint32_t fence);
+
+int ved_context_execbuf_fence_submit(object_context_p obj_context, uint32_t fence);
 
 
 int
@@ -117,6 +194,7 @@ void ved_execbuf_dma_write_bitstream(ipvr_execbuffer_p execbuf,
 
 void ved_execbuf_dma_write_bitstream_chained(ipvr_execbuffer_p execbuf,
         drm_ipvr_bo *bitstream_buf,
+        uint32_t buffer_offset,
         uint32_t size_in_bytes);
 
 /*
@@ -160,7 +238,11 @@ void ved_execbuf_rendec_start(ipvr_execbuffer_p execbuf, uint32_t dest_address);
 #define ved_execbuf_rendec_write( execbuf, val ) \
     EMIT_DWORD(execbuf, val)
 
-void ved_execbuf_rendec_write_block(ipvr_execbuffer_p execbuf,
+/*
+ * Copy "size" bytes into the open RENDEC block, returns -ENOSPC if they
+ * don't fit in the CtrlAlloc BO
+ */
+int ved_execbuf_rendec_write_block(ipvr_execbuffer_p execbuf,
                                    unsigned char *block,
                                    uint32_t size);
 
@@ -183,6 +265,26 @@ void ved_execbuf_skip_start_block(ipvr_execbuffer_p execbuf, uint32_t skip_condi
  */
 void ved_execbuf_skip_end_block(ipvr_execbuffer_p execbuf);
 
+/*
+ * Program a stream state register (RENDEC or host register)
+ *
+ * With IPVR_VIDEO_SHADOW_REGS set, a write of the value this context
+ * last programmed is held back and re-emitted by
+ * ved_execbuf_replay_state() inside a SKIP_ON_CONTEXT_SWITCH block.
+ */
+void ved_execbuf_reg_set_state(ipvr_execbuffer_p execbuf, uint32_t reg, uint32_t val);
+
+/*
+ * Returns non-zero if the *_state writes are shadowed. Without
+ * shadowing each one is emitted as its own block, callers that care
+ * about the stream size group the registers themselves instead.
+ */
+int ved_execbuf_state_shadowed(ipvr_execbuffer_p execbuf);
+
+void ved_execbuf_rendec_write_state(ipvr_execbuffer_p execbuf, uint32_t dest_address, uint32_t val);
+
+void ved_execbuf_replay_state(ipvr_execbuffer_p execbuf);
+
 /*
  * Terminate a conditional SKIP block
  */
@@ -69,7 +69,198 @@ void vld_dec_FE_state(object_context_p obj_context, drm_ipvr_bo *buf)
     cmd_header->ui32AltOutputAddr[1] = 0;
 }
 
-/* Programme the Alt output if there is a rotation*/
+/* 1.0 in the 3.12 fixed point scale pitch */
+#define SCALER_PITCH_ONE        (1 << 12)
+/* the 15 bit pitch field limits the downscale factor */
+#define SCALER_MAX_FACTOR       (8)
+
+/*
+ * Fills the coefficient registers of one scaler direction. Register
+ * "phase" holds the four 8 bit taps, adding up to 128, applied to the
+ * source pixels around an output pixel falling "phase" quarters past a
+ * source pixel. The taps sample a triangle filter stretched by the
+ * downscale factor, up to the two pixel radius four taps can cover.
+ */
+static void vld__scaler_coeffs(uint32_t *reg, uint32_t pitch)
+{
+    int32_t radius = pitch;
+    int phase, tap;
+
+    if (radius > 2 * SCALER_PITCH_ONE)
+        radius = 2 * SCALER_PITCH_ONE;
+
+    for (phase = 0; phase < 4; phase++) {
+        uint32_t weight[4], sum = 0, total = 0;
+        int largest = 0;
+
+        for (tap = 0; tap < 4; tap++) {
+            /* distance to source pixel "tap - 1", in source pixels */
+            int32_t dist = (tap - 1) * SCALER_PITCH_ONE - phase * (SCALER_PITCH_ONE / 4);
+
+            if (dist < 0)
+                dist = -dist;
+            weight[tap] = dist < radius ? radius - dist : 0;
+            sum += weight[tap];
+        }
+        for (tap = 0; tap < 4; tap++) {
+            weight[tap] = (weight[tap] * 128 + sum / 2) / sum;
+            total += weight[tap];
+            if (weight[tap] > weight[largest])
+                largest = tap;
+        }
+        /* keep the DC gain exact despite the rounding */
+        weight[largest] += 128 - total;
+
+        reg[phase] = 0;
+        REGIO_WRITE_FIELD_LITE(reg[phase], MSVDX_CMDS, HORIZONTAL_LUMA_COEFFICIENTS, HOR_LUMA_COEFF_0, weight[0]);
+        REGIO_WRITE_FIELD_LITE(reg[phase], MSVDX_CMDS, HORIZONTAL_LUMA_COEFFICIENTS, HOR_LUMA_COEFF_1, weight[1]);
+        REGIO_WRITE_FIELD_LITE(reg[phase], MSVDX_CMDS, HORIZONTAL_LUMA_COEFFICIENTS, HOR_LUMA_COEFF_2, weight[2]);
+        REGIO_WRITE_FIELD_LITE(reg[phase], MSVDX_CMDS, HORIZONTAL_LUMA_COEFFICIENTS, HOR_LUMA_COEFF_3, weight[3]);
+    }
+}
+
+/*
+ * Computes the scaler registers for a "src_width" x "src_height" picture
+ * scaled to "dst_width" x "dst_height". The pitch is the step in source
+ * pixels between output pixels and the initial position centres the
+ * first output pixel on the source pixels it covers.
+ */
+static void vld__calculate_scaler(context_DEC_p ctx, uint32_t src_width, uint32_t src_height,
+                                  uint32_t dst_width, uint32_t dst_height)
+{
+    uint32_t h_pitch = (src_width * SCALER_PITCH_ONE + dst_width / 2) / dst_width;
+    uint32_t v_pitch = (src_height * SCALER_PITCH_ONE + dst_height / 2) / dst_height;
+
+    ctx->h_scaler_ctrl = 0;
+    REGIO_WRITE_FIELD_LITE(ctx->h_scaler_ctrl, MSVDX_CMDS, HORIZONTAL_SCALE_CONTROL, HORIZONTAL_SCALE_PITCH, h_pitch);
+    REGIO_WRITE_FIELD_LITE(ctx->h_scaler_ctrl, MSVDX_CMDS, HORIZONTAL_SCALE_CONTROL, HORIZONTAL_INITIAL_POS,
+        (h_pitch - SCALER_PITCH_ONE) / 2);
+    ctx->v_scaler_ctrl = 0;
+    REGIO_WRITE_FIELD_LITE(ctx->v_scaler_ctrl, MSVDX_CMDS, VERTICAL_SCALE_CONTROL, VERTICAL_SCALE_PITCH, v_pitch);
+    REGIO_WRITE_FIELD_LITE(ctx->v_scaler_ctrl, MSVDX_CMDS, VERTICAL_SCALE_CONTROL, VERTICAL_INITIAL_POS,
+        (v_pitch - SCALER_PITCH_ONE) / 2);
+
+    /* NV12 chroma is subsampled by two both ways, so the factors match */
+    vld__scaler_coeffs(ctx->scaler_coeff_reg[0][0], h_pitch);
+    vld__scaler_coeffs(ctx->scaler_coeff_reg[0][1], v_pitch);
+    vld__scaler_coeffs(ctx->scaler_coeff_reg[1][0], h_pitch);
+    vld__scaler_coeffs(ctx->scaler_coeff_reg[1][1], v_pitch);
+
+    ctx->scaler_src_size = (src_width << 16) | src_height;
+    ctx->scaler_dst_size = (dst_width << 16) | dst_height;
+    drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s %dx%d -> %dx%d, pitch 0x%x/0x%x\n", __func__,
+        src_width, src_height, dst_width, dst_height, h_pitch, v_pitch);
+}
+
+/* Programme the scaled size, the scaler controls and the filter taps */
+static void vld__write_scaler(object_context_p obj_context)
+{
+    uint32_t cmd = 0;
+    ipvr_execbuffer_p execbuf = obj_context->execbuf;
+    context_DEC_p ctx = (context_DEC_p) obj_context->format_data;
+    uint32_t src_size = (obj_context->picture_width << 16) | obj_context->picture_height;
+    uint32_t dst_size = (ctx->alt_output_width << 16) | ctx->alt_output_height;
+    int i, j;
+
+    if (ctx->scaler_src_size != src_size || ctx->scaler_dst_size != dst_size)
+        vld__calculate_scaler(ctx, obj_context->picture_width, obj_context->picture_height,
+            ctx->alt_output_width, ctx->alt_output_height);
+
+    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, SCALED_DISPLAY_SIZE));
+    REGIO_WRITE_FIELD_LITE(cmd, MSVDX_CMDS, SCALED_DISPLAY_SIZE, SCALE_DISPLAY_WIDTH, ctx->alt_output_width - 1);
+    REGIO_WRITE_FIELD_LITE(cmd, MSVDX_CMDS, SCALED_DISPLAY_SIZE, SCALE_DISPLAY_HEIGHT, ctx->alt_output_height - 1);
+    ved_execbuf_rendec_write(execbuf, cmd);
+    ved_execbuf_rendec_write(execbuf, ctx->h_scaler_ctrl);
+    ved_execbuf_rendec_write(execbuf, ctx->v_scaler_ctrl);
+    ved_execbuf_rendec_end(execbuf);
+
+    /* luma horizontal, luma vertical, chroma horizontal, chroma vertical */
+    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, HORIZONTAL_LUMA_COEFFICIENTS));
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            ved_execbuf_rendec_write(execbuf, ctx->scaler_coeff_reg[i][j][0]);
+            ved_execbuf_rendec_write(execbuf, ctx->scaler_coeff_reg[i][j][1]);
+            ved_execbuf_rendec_write(execbuf, ctx->scaler_coeff_reg[i][j][2]);
+            ved_execbuf_rendec_write(execbuf, ctx->scaler_coeff_reg[i][j][3]);
+        }
+    }
+    ved_execbuf_rendec_end(execbuf);
+}
+
+#ifdef VA_DEC_PROCESSING
+/*
+ * Takes a VAProcPipelineParameterBuffer rendered into a decode context:
+ * its first additional output receives a downscaled NV12 copy of the
+ * picture, written by the hardware scaler in the same pass. The size is
+ * that of "output_region" if given, of the surface otherwise.
+ */
+VAStatus vld_dec_process_alt_output(context_DEC_p ctx, object_buffer_p obj_buffer)
+{
+    object_context_p obj_context = ctx->obj_context;
+    VAProcPipelineParameterBuffer *pipeline = (VAProcPipelineParameterBuffer *) obj_buffer->buffer_data;
+    object_surface_p obj_surface;
+    uint32_t width, height;
+
+    if ((obj_buffer->num_elements != 1) ||
+        (obj_buffer->size != sizeof(VAProcPipelineParameterBuffer))) {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    if (pipeline->num_filters || pipeline->rotation_state != VA_ROTATION_NONE) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s only scaling is done while decoding\n", __func__);
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    }
+
+    if (pipeline->num_additional_outputs == 0) {
+        ctx->alt_output_surface = NULL;
+        return VA_STATUS_SUCCESS;
+    }
+
+    obj_surface = (object_surface_p) object_heap_lookup(&obj_context->driver_data->surface_heap,
+        pipeline->additional_outputs[0]);
+    if (NULL == obj_surface || NULL == obj_surface->ipvr_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    if (obj_surface == obj_context->current_render_target)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    /* vaSyncSurface() flushes the context owning the surface */
+    if (obj_surface->context_id != -1 && obj_surface->context_id != obj_context->context_id)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    if (obj_surface->ipvr_surface->fourcc != VA_FOURCC_NV12 ||
+        obj_surface->ipvr_surface->stride_mode >= STRIDE_NA) {
+        /* ROTATION_ROW_STRIDE only knows the fixed strides */
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s scaled output must be NV12 with a fixed stride\n", __func__);
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+
+    width = obj_surface->width;
+    height = obj_surface->height;
+    if (pipeline->output_region) {
+        if (pipeline->output_region->x || pipeline->output_region->y ||
+            pipeline->output_region->width > width || pipeline->output_region->height > height)
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        width = pipeline->output_region->width;
+        height = pipeline->output_region->height;
+    }
+
+    /* downscaling only */
+    if (width == 0 || height == 0 ||
+        width > (uint32_t)obj_context->picture_width || height > (uint32_t)obj_context->picture_height ||
+        width * SCALER_MAX_FACTOR <= (uint32_t)obj_context->picture_width ||
+        height * SCALER_MAX_FACTOR <= (uint32_t)obj_context->picture_height) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s cannot scale %dx%d to %dx%d\n", __func__,
+            obj_context->picture_width, obj_context->picture_height, width, height);
+        return VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED;
+    }
+
+    obj_surface->context_id = obj_context->context_id; /* Claim ownership of surface */
+    ctx->alt_output_surface = obj_surface;
+    ctx->alt_output_width = width;
+    ctx->alt_output_height = height;
+    return VA_STATUS_SUCCESS;
+}
+#endif
+
+/* Programme the Alt output if there is a rotation or a scaled output */
 void vld_dec_setup_alternative_frame(object_context_p obj_context)
 {
     uint32_t cmd = 0;
@@ -86,6 +277,26 @@ void vld_dec_setup_alternative_frame(object_context_p obj_context)
         REGIO_WRITE_FIELD_LITE(cmd, MSVDX_CMDS, ALTERNATIVE_OUTPUT_PICTURE_ROTATION, USE_AUX_LINE_BUF, 1);
     }
 
+    if (ctx->alt_output_surface) {
+        ipvr_surface_p alt_surface = ctx->alt_output_surface->ipvr_surface;
+
+        vld__write_scaler(obj_context);
+
+        /* the alternative output goes through the range mapping addresses */
+        ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, VC1_LUMA_RANGE_MAPPING_BASE_ADDRESS));
+        ved_execbuf_rendec_write_address(execbuf, alt_surface->buf, alt_surface->luma_offset, 0);
+        ved_execbuf_rendec_write_address(execbuf, alt_surface->buf, alt_surface->chroma_offset, 0);
+        ved_execbuf_rendec_end(execbuf);
+        RELOC(execbuf, *ctx->p_range_mapping_base0, alt_surface->luma_offset, alt_surface->buf, 0);
+        RELOC(execbuf, *ctx->p_range_mapping_base1, alt_surface->chroma_offset, alt_surface->buf, 0);
+
+        /* the full size picture is still written, it is a reference */
+        REGIO_WRITE_FIELD_LITE(cmd, MSVDX_CMDS, ALTERNATIVE_OUTPUT_PICTURE_ROTATION, ALT_PICTURE_ENABLE, 1);
+        REGIO_WRITE_FIELD_LITE(cmd, MSVDX_CMDS, ALTERNATIVE_OUTPUT_PICTURE_ROTATION, ROTATION_ROW_STRIDE,
+            alt_surface->stride_mode);
+        REGIO_WRITE_FIELD_LITE(cmd, MSVDX_CMDS, ALTERNATIVE_OUTPUT_PICTURE_ROTATION, RECON_WRITE_DISABLE, 0);
+    }
+
     /* Set the rotation registers */
     ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, ALTERNATIVE_OUTPUT_PICTURE_ROTATION));
     ved_execbuf_rendec_write(execbuf, cmd);
@@ -198,15 +409,23 @@ VAStatus vld_dec_process_slice(context_DEC_p ctx,
         (slice_param->slice_data_flag == VA_SLICE_DATA_FLAG_ALL)) {
         ASSERT(!ctx->split_buffer_pending);
 
+        /* only a slice that does not fit makes us submit mid-picture */
+        if (ved_context_reserve_execbuf(ctx->obj_context)) {
+            vaStatus = VA_STATUS_ERROR_UNKNOWN;
+            DEBUG_FAILURE;
+            return vaStatus;
+        }
+
         vld_dec_FE_state(ctx->obj_context, ctx->preload_buffer);
         ctx->begin_slice(ctx, slice_param);
         drv_debug_msg(VIDEO_DEBUG_GENERAL, "setting slice data buffer to %x (off 0x%lx)\n",
             obj_buffer->ipvr_bo->handle, obj_buffer->ipvr_bo->offset);
 
         ctx->slice_data_buffer = obj_buffer->ipvr_bo;
+        ctx->slice_data_buffer_offset = obj_buffer->bo_offset;
             ved_execbuf_dma_write_bitstream(ctx->obj_context->execbuf,
                                          obj_buffer->ipvr_bo,
-                                         slice_param->slice_data_offset,
+                                         obj_buffer->bo_offset + slice_param->slice_data_offset,
                                          slice_param->slice_data_size,
                                          ctx->bits_offset,
                                          ctx->SR_flags);
@@ -220,6 +439,7 @@ VAStatus vld_dec_process_slice(context_DEC_p ctx,
         if (slice_param->slice_data_size) {
             ved_execbuf_dma_write_bitstream_chained(ctx->obj_context->execbuf,
                     obj_buffer->ipvr_bo,
+                    obj_buffer->bo_offset,
                     slice_param->slice_data_size);
         }
     }
@@ -246,16 +466,6 @@ VAStatus vld_dec_process_slice(context_DEC_p ctx,
                 VED_COMMAND_FE_DECODE, &arg, sizeof(arg))) {
             vaStatus = VA_STATUS_ERROR_UNKNOWN;
         }
-        if (ipvr_execbuffer_full(ctx->obj_context->execbuf)) {
-            ipvr_execbuffer_run(ctx->obj_context->execbuf);
-            ipvr_execbuffer_put(ctx->obj_context->execbuf);
-            if (ved_context_get_execbuf(ctx->obj_context)) {
-                vaStatus = VA_STATUS_ERROR_UNKNOWN;
-                DEBUG_FAILURE;
-                return vaStatus;
-            }
-            
-        }
     }
     return vaStatus;
 }
@@ -318,11 +528,21 @@ VAStatus vld_dec_BeginPicture(
     context_DEC_p ctx, object_context_p obj_context)
 {
     int ret;
-    ctx->aux_line_buffer_vld = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-aux_line_buffer_vld",
-        AUX_LINE_BUFFER_VLD_SIZE, 0, IPVR_CACHE_UNCACHED);
+
+    /* a scaled output is requested per picture */
+    ctx->alt_output_surface = NULL;
+    /*
+     * Only the hardware touches the aux line buffer and it decodes the
+     * pictures of a context in order, so one buffer serves the whole stream
+     */
     if (!ctx->aux_line_buffer_vld) {
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        ctx->aux_line_buffer_vld = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
+            ctx->obj_context->ipvr_ctx, "VED-aux_line_buffer_vld",
+            AUX_LINE_BUFFER_VLD_SIZE, 0, IPVR_CACHE_UNCACHED);
+        if (!ctx->aux_line_buffer_vld) {
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+        ctx->picture_bo_allocs++;
     }
     ret = ved_context_get_execbuf(obj_context);
     if (ret) {
@@ -334,10 +554,11 @@ VAStatus vld_dec_BeginPicture(
 VAStatus vld_dec_EndPicture(
     context_DEC_p ctx)
 {
-    ipvr_execbuffer_put(ctx->obj_context->execbuf);
-    //ctx->obj_context->execbuf = NULL;
-    if (ctx->aux_line_buffer_vld)
-        drm_ipvr_gem_bo_unreference(ctx->aux_line_buffer_vld);
+    /* the execbuf is released by ved_context_end_execbuf() once submitted */
+    if (ctx->picture_bo_allocs)
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s %d BOs allocated for this picture\n",
+            __func__, ctx->picture_bo_allocs);
+    ctx->picture_bo_allocs = 0;
     return VA_STATUS_SUCCESS;
 }
 
@@ -352,6 +573,12 @@ VAStatus vld_dec_CreateContext(context_DEC_p ctx, object_context_p obj_context)
         goto err;
     }
 
+    if (ved_context_create_execbuf_ring(obj_context)) {
+        vaStatus = VA_STATUS_ERROR_ALLOCATION_FAILED;
+        DEBUG_FAILURE;
+        goto err;
+    }
+
     ctx->obj_context = obj_context;
     ctx->split_buffer_pending = FALSE;
     ctx->slice_param_list_size = 8;
@@ -376,6 +603,7 @@ VAStatus vld_dec_CreateContext(context_DEC_p ctx, object_context_p obj_context)
     return VA_STATUS_SUCCESS;
 
 err:
+    ved_context_destroy_execbuf_ring(obj_context);
     if (obj_context->execbuf) {
         free(obj_context->execbuf);
     }
@@ -407,7 +635,13 @@ void vld_dec_DestroyContext(context_DEC_p ctx)
         ctx->colocated_buffers = NULL;
       }
     
-    ipvr_execbuffer_put(obj_context->execbuf);
+    ved_context_flush_execbuf(obj_context);
+    ved_context_destroy_execbuf_ring(obj_context);
+
+    if (ctx->aux_line_buffer_vld) {
+        drm_ipvr_gem_bo_unreference(ctx->aux_line_buffer_vld);
+        ctx->aux_line_buffer_vld = NULL;
+    }
 
     free(obj_context->execbuf);
     
@@ -440,6 +674,13 @@ VAStatus vld_dec_RenderPicture(
             DEBUG_FAILURE;
             break;
 
+#ifdef VA_DEC_PROCESSING
+        case VAProcPipelineParameterBufferType:
+            vaStatus = vld_dec_process_alt_output(ctx, obj_buffer);
+            DEBUG_FAILURE;
+            break;
+#endif
+
         default:
             vaStatus = ctx->process_buffer(ctx, obj_buffer);
             DEBUG_FAILURE;
@@ -47,6 +47,10 @@ struct context_DEC_s {
     drm_ipvr_bo *aux_line_buffer_vld;
     drm_ipvr_bo *preload_buffer;
     drm_ipvr_bo *slice_data_buffer;
+    uint32_t slice_data_buffer_offset;
+
+    /* BOs allocated for the current picture, 0 once scratch BOs are warm */
+    int picture_bo_allocs;
 
     /* Split buffers */
     int split_buffer_pending;
@@ -72,6 +76,18 @@ struct context_DEC_s {
     uint32_t scaler_coeff_reg[2][2][4];
     uint32_t h_scaler_ctrl;
     uint32_t v_scaler_ctrl;
+
+    /*
+     * Downscaled copy of the current picture requested through a
+     * VAProcPipelineParameterBuffer, NULL if none. The scaler state above
+     * was computed for "scaler_src_size" to "scaler_dst_size", each
+     * width << 16 | height.
+     */
+    object_surface_p alt_output_surface;
+    uint32_t alt_output_width;
+    uint32_t alt_output_height;
+    uint32_t scaler_src_size;
+    uint32_t scaler_dst_size;
 };
 
 #define AUX_LINE_BUFFER_VLD_SIZE        (1024*152)
@@ -80,6 +96,9 @@ typedef struct context_DEC_s *context_DEC_p;
 
 void vld_dec_FE_state(object_context_p, drm_ipvr_bo*);
 void vld_dec_setup_alternative_frame(object_context_p);
+#ifdef VA_DEC_PROCESSING
+VAStatus vld_dec_process_alt_output(context_DEC_p, object_buffer_p);
+#endif
 VAStatus vld_dec_process_slice_data(context_DEC_p, object_buffer_p);
 VAStatus vld_dec_add_slice_param(context_DEC_p, object_buffer_p);
 VAStatus vld_dec_allocate_colocated_buffer(context_DEC_p, object_surface_p, uint32_t);
@@ -47,6 +47,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define VEC_MODE_VP8    11
 
@@ -212,6 +218,34 @@ static const uint32_t RegEntdecFeControl = ( (VEC_MODE_VP8 & 0x7) << MSVDX_VEC_C
 #define VP8_FRAMETYPE_SHIFT     (27)
 
 #define MAX_MB_SEGMENTS         4
+
+/* Stream state registers, see tng__VP8_write_stream_state() */
+enum {
+    VP8_STATE_ENTDEC_BE_CONTROL = 0,
+    VP8_STATE_BE_PIC1,
+    VP8_STATE_BE_PIC2,
+    VP8_STATE_DISPLAY_PICTURE_SIZE,
+    VP8_STATE_CODED_PICTURE_SIZE,
+    VP8_STATE_OPERATING_MODE,
+    VP8_STATE_MC_CACHE_CONFIGURATION,
+    VP8_STATE_COUNT
+};
+
+/* compiled probability BOs kept per partition, see tng__VP8_prob_cache_get */
+#define VP8_PROB_CACHE_SIZE         4
+#define VP8_PROB_KEY_SIZE           (sizeof(VAProbabilityDataBufferVP8))
+/* segment ID maps, one in use while the other may be reset */
+#define VP8_SEG_MAPS                2
+/* per-picture scratch sets rotated by tng_VP8_BeginPicture */
+#define VP8_PICTURE_SETS            2
+
+/* parameter blobs taken over from VA buffers, see tng__VP8_take_param */
+enum {
+    VP8_PARAM_PICTURE = 0,
+    VP8_PARAM_PROBABILITY,
+    VP8_PARAM_IQ,
+    VP8_PARAM_COUNT
+};
 #define SEGMENT_DELTADATA       0
 #define SEGMENT_ABSDATA         1
 #define MAX_LOOP_FILTER         63
@@ -269,6 +303,9 @@ struct context_VP8_s {
     /* VP8 Inverse Quantization Matrix Buffer */
     VAIQMatrixBufferVP8 *iq_params;
 
+    /* retired parameter blobs, handed back to the next buffer of that kind */
+    void *param_spare[VP8_PARAM_COUNT];
+
     VASliceParameterBufferVP8   *slice_params;
 
     object_surface_p    golden_ref_picture;
@@ -290,6 +327,9 @@ struct context_VP8_s {
     uint16_t        cache_ref_offset;
     uint16_t        cache_row_offset;
 
+    /* stream resolution the scratch buffer sizes below are derived from */
+    uint32_t        frame_width;
+    uint32_t        frame_height;
     uint32_t        buffer_size;
     uint32_t        segid_size;
 
@@ -309,6 +349,23 @@ struct context_VP8_s {
     uint32_t        cmd_slice_params;
 
 /*      VP8 features        */
+    /*
+     * Buffers the front end fills for the back end of the same picture.
+     * Pictures are decoded in order, but the front end may start on the
+     * next picture while the back end still reads these, so consecutive
+     * pictures use different sets. Buffers used by one end only, such as
+     * the intra and aux line buffers, need a single instance. Nothing
+     * chains through these from one picture to the next; the pointers
+     * below refer to the set of the current picture.
+     */
+    struct tng_VP8_picture_set_s {
+        drm_ipvr_bo *MB_flags_buffer;
+        drm_ipvr_bo *cur_pic_buffer;
+        drm_ipvr_bo *buffer_1st_part;
+    } pic_set[VP8_PICTURE_SETS];
+    int             pic_set_count;
+    int             pic_set_idx;
+
     /* MB Flags Buffer */
     drm_ipvr_bo     *MB_flags_buffer;
 
@@ -318,7 +375,16 @@ struct context_VP8_s {
     /* 1 St Part Buffer */
     drm_ipvr_bo     *buffer_1st_part;
 
+    /*
+     * Segment ID map of the stream. The hardware reads and updates it in
+     * place, so it persists across pictures for the "previous" SEG_ID_CTRL
+     * mode; a reset switches to the other map of seg_map[] and clears it
+     * rather than waiting for pictures still using the current one.
+     */
     drm_ipvr_bo     *segID_buffer;
+    drm_ipvr_bo     *seg_map[VP8_SEG_MAPS];
+    uint32_t        seg_map_fence[VP8_SEG_MAPS];
+    int             seg_map_idx;
 
     /* Probability tables */                                                                                                                                               
     uint32_t        probability_data_buffer_size;
@@ -331,10 +397,244 @@ struct context_VP8_s {
     drm_ipvr_bo     *probability_data_2nd_part;
 
     drm_ipvr_bo     *intra_buffer;
+
+    /*
+     * The buffers above are kept for the life of the context. Probability
+     * tables are compiled into BOs cached by the content of their source
+     * arrays; "fence" is the last picture using a BO, 0 for a free entry.
+     */
+    struct tng_VP8_prob_cache_s {
+        drm_ipvr_bo *bo;
+        uint32_t    hash;
+        uint32_t    fence;
+        uint8_t     key[VP8_PROB_KEY_SIZE];
+    } prob_cache[2][VP8_PROB_CACHE_SIZE];
+    uint32_t        prob_cache_hits;
+    uint32_t        prob_cache_misses;
 };
 
 typedef struct context_VP8_s    *context_VP8_p;
 
+/*
+ * Makes sure "*bo" is at least "size" bytes, replacing a smaller one
+ */
+static int tng__VP8_scratch_bo(context_VP8_p ctx, drm_ipvr_bo **bo,
+                               const char *name, uint32_t size, uint32_t cache)
+{
+    if (*bo && (*bo)->size >= size)
+        return 0;
+    if (*bo)
+        drm_ipvr_gem_bo_unreference(*bo);
+    *bo = drm_ipvr_gem_bo_alloc(ctx->obj_context->driver_data->bufmgr,
+        ctx->obj_context->ipvr_ctx, name, size, 0, cache);
+    if (!*bo)
+        return -ENOMEM;
+    ctx->dec_ctx.picture_bo_allocs++;
+    return 0;
+}
+
+/*
+ * Waits until the hardware is done with "bo", last used by picture "fence"
+ */
+static int tng__VP8_fence_wait(context_VP8_p ctx, uint32_t fence, drm_ipvr_bo *bo)
+{
+    if (!fence || !bo)
+        return 0;
+    if (ved_context_execbuf_fence_submit(ctx->obj_context, fence))
+        return -EIO;
+    if (drm_ipvr_gem_bo_busy(bo)) {
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s waiting for picture %u\n", __func__, fence);
+        drm_ipvr_gem_bo_wait(bo);
+    }
+    return 0;
+}
+
+static uint32_t tng__VP8_prob_hash(const uint8_t *key, uint32_t size)
+{
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    uint32_t i;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ key[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * Looks up the BO compiled from "key" in the probability cache of
+ * partition "part". On a miss the least recently used entry is recycled,
+ * once the hardware is done with it, and "*compile" tells the caller to
+ * compile "key" into the returned BO.
+ */
+static drm_ipvr_bo *tng__VP8_prob_cache_get(context_VP8_p ctx, int part,
+                                            const uint8_t *key, uint32_t key_size,
+                                            uint32_t bo_size, int *compile)
+{
+    struct tng_VP8_prob_cache_s *cache = ctx->prob_cache[part];
+    struct tng_VP8_prob_cache_s *entry = NULL;
+    uint32_t fence = ved_context_execbuf_fence(ctx->obj_context);
+    uint32_t hash = tng__VP8_prob_hash(key, key_size);
+    int i;
+
+    ASSERT(key_size <= VP8_PROB_KEY_SIZE);
+    *compile = 0;
+    for (i = 0; i < VP8_PROB_CACHE_SIZE; i++) {
+        if (cache[i].fence && cache[i].hash == hash &&
+            cache[i].bo->size >= bo_size && !memcmp(cache[i].key, key, key_size)) {
+            ctx->prob_cache_hits++;
+            cache[i].fence = fence;
+            return cache[i].bo;
+        }
+        if (!entry || !cache[i].fence ||
+            (entry->fence && (int32_t)(cache[i].fence - entry->fence) < 0))
+            entry = &cache[i];
+    }
+
+    ctx->prob_cache_misses++;
+    if (tng__VP8_fence_wait(ctx, entry->fence, entry->bo))
+        return NULL;
+    entry->fence = 0;
+    if (tng__VP8_scratch_bo(ctx, &entry->bo, part ? "VED-VP8-probability_data_2nd_part" :
+            "VED-VP8-probability_data_1st_part", bo_size, IPVR_CACHE_WRITECOMBINE))
+        return NULL;
+    entry->hash = hash;
+    memcpy(entry->key, key, key_size);
+    entry->fence = fence;
+    *compile = 1;
+    return entry->bo;
+}
+
+/*
+ * Selects the segment ID map for the current picture. The map carries
+ * over from the previous picture unless this is a key frame that does not
+ * rewrite it, or the picture size outgrew it; then the other map is
+ * cleared to segment 0 and used instead.
+ */
+static VAStatus tng__VP8_select_seg_map(context_VP8_p ctx)
+{
+    int idx = ctx->seg_map_idx;
+    drm_ipvr_bo *seg_map;
+
+    if (!ctx->segID_buffer || ctx->segID_buffer->size < ctx->segid_size ||
+        (ctx->pic_params->pic_fields.bits.key_frame == 0 &&
+         !ctx->pic_params->pic_fields.bits.update_mb_segmentation_map)) {
+        idx = (ctx->seg_map_idx + 1) % VP8_SEG_MAPS;
+        if (tng__VP8_fence_wait(ctx, ctx->seg_map_fence[idx], ctx->seg_map[idx]))
+            return VA_STATUS_ERROR_UNKNOWN;
+        if (tng__VP8_scratch_bo(ctx, &ctx->seg_map[idx], "VED-VP8-segID_buffer",
+                ctx->segid_size, IPVR_CACHE_UNCACHED))
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        seg_map = ctx->seg_map[idx];
+        if (drm_ipvr_gem_bo_map(seg_map, 1)) {
+            drv_debug_msg(VIDEO_DEBUG_ERROR, "%s failed to map segment ID map\n", __func__);
+            return VA_STATUS_ERROR_UNKNOWN;
+        }
+        memset(seg_map->virt, 0, seg_map->size);
+        drm_ipvr_gem_bo_unmap(seg_map);
+        ctx->seg_map_idx = idx;
+        ctx->segID_buffer = seg_map;
+    }
+    ctx->seg_map_fence[idx] = ved_context_execbuf_fence(ctx->obj_context);
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * Forgets the cache entry of "bo" when it could not be compiled
+ */
+static void tng__VP8_prob_cache_drop(context_VP8_p ctx, int part, drm_ipvr_bo *bo)
+{
+    int i;
+
+    for (i = 0; i < VP8_PROB_CACHE_SIZE; i++) {
+        if (ctx->prob_cache[part][i].bo == bo)
+            ctx->prob_cache[part][i].fence = 0;
+    }
+}
+
+/*
+ * Take over the data of a parameter buffer without a heap round trip: the
+ * previous blob of that kind goes back to obj_buffer, whose next
+ * ipvr__allocate_malloc_buffer() then finds a block of the right size.
+ */
+static void tng__VP8_take_param(context_VP8_p ctx, int kind, void **param, object_buffer_p obj_buffer)
+{
+    void *spare = ctx->param_spare[kind];
+
+    if (*param) {
+        if (spare)
+            free(*param);
+        else
+            spare = *param;
+    }
+
+    *param = obj_buffer->buffer_data;
+    obj_buffer->buffer_data = spare;
+    obj_buffer->alloc_size = spare ? obj_buffer->size : 0;
+    obj_buffer->size = 0;
+    ctx->param_spare[kind] = NULL;
+}
+
+static void tng__VP8_release_param(context_VP8_p ctx, int kind, void **param)
+{
+    if (*param == NULL)
+        return;
+
+    if (ctx->param_spare[kind])
+        free(*param);
+    else
+        ctx->param_spare[kind] = *param;
+    *param = NULL;
+}
+
+static void tng__VP8_release_params(context_VP8_p ctx)
+{
+    tng__VP8_release_param(ctx, VP8_PARAM_PICTURE, (void **)&ctx->pic_params);
+    tng__VP8_release_param(ctx, VP8_PARAM_PROBABILITY, (void **)&ctx->probs_params);
+    tng__VP8_release_param(ctx, VP8_PARAM_IQ, (void **)&ctx->iq_params);
+}
+
+static void tng__VP8_free_scratch(context_VP8_p ctx)
+{
+    int i;
+
+    if (ctx->prob_cache_hits + ctx->prob_cache_misses)
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s probability cache: %u hits, %u misses\n",
+            __func__, ctx->prob_cache_hits, ctx->prob_cache_misses);
+    for (i = 0; i < VP8_PROB_CACHE_SIZE; i++) {
+        if (ctx->prob_cache[0][i].bo)
+            drm_ipvr_gem_bo_unreference(ctx->prob_cache[0][i].bo);
+        if (ctx->prob_cache[1][i].bo)
+            drm_ipvr_gem_bo_unreference(ctx->prob_cache[1][i].bo);
+    }
+    memset(ctx->prob_cache, 0, sizeof(ctx->prob_cache));
+    ctx->probability_data_1st_part = NULL;
+    ctx->probability_data_2nd_part = NULL;
+
+    for (i = 0; i < VP8_PICTURE_SETS; i++) {
+        struct tng_VP8_picture_set_s *set = &ctx->pic_set[i];
+
+        if (set->cur_pic_buffer)
+            drm_ipvr_gem_bo_unreference(set->cur_pic_buffer);
+        if (set->buffer_1st_part)
+            drm_ipvr_gem_bo_unreference(set->buffer_1st_part);
+        if (set->MB_flags_buffer)
+            drm_ipvr_gem_bo_unreference(set->MB_flags_buffer);
+    }
+    memset(ctx->pic_set, 0, sizeof(ctx->pic_set));
+    for (i = 0; i < VP8_SEG_MAPS; i++) {
+        if (ctx->seg_map[i])
+            drm_ipvr_gem_bo_unreference(ctx->seg_map[i]);
+        ctx->seg_map[i] = NULL;
+        ctx->seg_map_fence[i] = 0;
+    }
+    if (ctx->intra_buffer)
+        drm_ipvr_gem_bo_unreference(ctx->intra_buffer);
+    ctx->cur_pic_buffer = NULL;
+    ctx->buffer_1st_part = NULL;
+    ctx->segID_buffer = NULL;
+    ctx->MB_flags_buffer = NULL;
+    ctx->intra_buffer = NULL;
+}
+
 #define INIT_CONTEXT_VP8    context_VP8_p    ctx = (context_VP8_p) obj_context->format_data;
 
 #define SURFACE(id)    ((object_surface_p) object_heap_lookup( &ctx->obj_context->driver_data->surface_heap, id ))
@@ -414,6 +714,12 @@ static void tng_VP8_QueryConfigAttributes(
             else
                 attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
             break;
+#endif
+#ifdef VA_DEC_PROCESSING
+        case VAConfigAttribDecProcessing:
+            /* downscaled output, see vld_dec_process_alt_output() */
+            attrib_list[i].value = VA_DEC_PROCESSING;
+            break;
 #endif
         default:
             break;
@@ -432,6 +738,11 @@ static VAStatus tng_VP8_ValidateConfig(
             /* Ignore */
             break;
 
+#ifdef VA_DEC_PROCESSING
+        case VAConfigAttribDecProcessing:
+            break;
+#endif
+
         default:
             return VA_STATUS_ERROR_ATTR_NOT_SUPPORTED;
         }
@@ -441,7 +752,97 @@ static VAStatus tng_VP8_ValidateConfig(
 }
 
 
+/*
+ * Derives the scratch buffer sizes from the stream resolution
+ */
+static void tng__VP8_set_frame_size(context_VP8_p ctx, uint32_t width, uint32_t height)
+{
+    //uint32_t TotalMBs = ((obj_context->picture_width + 19) * obj_context->picture_height) / (16*16);
+    uint32_t total_mbs = (((height + 15) >> 4) + 4) * ((width + 15) >> 4);
+
+    ctx->frame_width = width;
+    ctx->frame_height = height;
+    ctx->buffer_size = total_mbs * 64;    /* 64 bytes per MB */
+    ctx->segid_size = total_mbs / 4;      /* 2 bits per MB */
+    ctx->segid_size = (ctx->segid_size + 0xfff) & ~0xfff;
+}
+
+/*
+ * Makes sure the scratch buffers fit the current stream resolution,
+ * only reallocating those that are too small
+ */
+static int tng__VP8_alloc_scratch(context_VP8_p ctx)
+{
+    struct tng_VP8_picture_set_s *set = &ctx->pic_set[ctx->pic_set_idx];
+
+    /*
+     * Only the hardware touches these buffers, so they are allocated once
+     * and reused. The set alternates between pictures, see pic_set; one
+     * left behind by a resolution change grows when its turn comes
+     */
+    /* Create mem resource for current picture macroblock data to be stored */
+    if (tng__VP8_scratch_bo(ctx, &set->cur_pic_buffer, "VED-VP8-cur_pic_buffer",
+            ctx->buffer_size, IPVR_CACHE_UNCACHED))
+        return -ENOMEM;
+
+    /* Create mem resource for storing 1st partition .*/
+    if (tng__VP8_scratch_bo(ctx, &set->buffer_1st_part, "VED-VP8-buffer_1st_part",
+            ctx->buffer_size, IPVR_CACHE_UNCACHED))
+        return -ENOMEM;
+
+    /* Create mem resource for PIC MB Flags .*/ 
+    /* one MB would take 2 bits to store Y2 flag and mb_skip_coeff flag, so size would be same as ui32segidsize */
+    if (tng__VP8_scratch_bo(ctx, &set->MB_flags_buffer, "VED-VP8-MB_flags_buffer",
+            ctx->segid_size, IPVR_CACHE_UNCACHED))
+        return -ENOMEM;
+
+    ctx->cur_pic_buffer = set->cur_pic_buffer;
+    ctx->buffer_1st_part = set->buffer_1st_part;
+    ctx->MB_flags_buffer = set->MB_flags_buffer;
+
+    /* only the back end uses it, within one picture */
+    if (tng__VP8_scratch_bo(ctx, &ctx->intra_buffer, "VED-VP8-intra_buffer",
+            INTRA_BUFFER_SIZE, IPVR_CACHE_UNCACHED))
+        return -ENOMEM;
+    return 0;
+}
+
+/*
+ * Follows a resolution change signalled by a key frame: the scratch
+ * buffers are resized in place, the segment map is reset by
+ * tng__VP8_select_seg_map and the picture size registers are derived
+ * from the picture parameters anyway
+ */
+static VAStatus tng__VP8_resize(context_VP8_p ctx, object_surface_p target)
+{
+    VAPictureParameterBufferVP8 *pic_params = ctx->pic_params;
+
+    if (pic_params->pic_fields.bits.key_frame != 0) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: %dx%d inter frame in a %dx%d stream\n", __func__,
+            pic_params->frame_width, pic_params->frame_height, ctx->frame_width, ctx->frame_height);
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    if (pic_params->frame_width > (uint32_t)target->width ||
+        pic_params->frame_height > (uint32_t)target->height) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s: %dx%d frame does not fit the %dx%d surface\n", __func__,
+            pic_params->frame_width, pic_params->frame_height, target->width, target->height);
+        return VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED;
+    }
+
+    drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s: resolution change %dx%d -> %dx%d\n", __func__,
+        ctx->frame_width, ctx->frame_height, pic_params->frame_width, pic_params->frame_height);
+    tng__VP8_set_frame_size(ctx, pic_params->frame_width, pic_params->frame_height);
+    ctx->obj_context->picture_width = pic_params->frame_width;
+    ctx->obj_context->picture_height = pic_params->frame_height;
+    if (tng__VP8_alloc_scratch(ctx))
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    return VA_STATUS_SUCCESS;
+}
+
 static void tng_VP8_DestroyContext(object_context_p obj_context);
+static VAStatus tng__VP8_init_key_frame_probs(object_context_p obj_context, uint32_t size);
+static VAStatus tng__VP8_compile_1st_part_probs(context_VP8_p ctx);
+static VAStatus tng__VP8_compile_2nd_part_probs(context_VP8_p ctx);
 
 static void tng__VP8_process_slice_data(context_DEC_p dec_ctx, VASliceParameterBufferBase *vld_slice_param);
 static void tng__VP8_end_slice(context_DEC_p dec_ctx);
@@ -476,16 +877,29 @@ static VAStatus tng_VP8_CreateContext(
     ctx->cache_ref_offset = 144;
     ctx->cache_row_offset = 8;
 
-    //uint32_t TotalMBs = ((obj_context->picture_width + 19) * obj_context->picture_height) / (16*16);
-    uint32_t total_mbs = (((obj_context->picture_height + 15) >> 4) + 4) * ((obj_context->picture_width + 15) >> 4);
-    ctx->buffer_size = total_mbs * 64;    /* 64 bytes per MB */
-    ctx->segid_size = total_mbs / 4;      /* 2 bits per MB */
-    ctx->segid_size = (ctx->segid_size + 0xfff) & ~0xfff;
+    tng__VP8_set_frame_size(ctx, obj_context->picture_width, obj_context->picture_height);
+
+    /* IPVR_VIDEO_VP8_PIPELINE=0 trades queueing depth for scratch memory */
+    ctx->pic_set_count = VP8_PICTURE_SETS;
+    {
+        char value[1024];
+
+        memset(value, 0, sizeof(value));
+        if (ipvr_parse_config("IPVR_VIDEO_VP8_PIPELINE", &value[0]) == 0 && atoi(value) == 0)
+            ctx->pic_set_count = 1;
+    }
 
     /* calculate the size of prbability buffer size for both the partitions */
     ctx->probability_data_1st_part_size = 1200;
     ctx->probability_data_2nd_part_size = 1200;
 
+    vaStatus = tng__VP8_init_key_frame_probs(obj_context, ctx->probability_data_1st_part_size);
+    if (vaStatus != VA_STATUS_SUCCESS) {
+        DEBUG_FAILURE;
+        free(obj_context->format_data);
+        obj_context->format_data = NULL;
+        return vaStatus;
+    }
 
     if (vaStatus == VA_STATUS_SUCCESS) {
         vaStatus = vld_dec_CreateContext(&ctx->dec_ctx, obj_context);
@@ -502,17 +916,15 @@ static VAStatus tng_VP8_CreateContext(
 static void tng_VP8_DestroyContext(
     object_context_p obj_context) {
     INIT_CONTEXT_VP8
+    int i;
 
     vld_dec_DestroyContext(&ctx->dec_ctx);
+    tng__VP8_free_scratch(ctx);
 
-    if (ctx->pic_params) {
-        free(ctx->pic_params);
-        ctx->pic_params = NULL;
-    }
-
-    if (ctx->probs_params) {
-        free(ctx->probs_params);
-        ctx->probs_params = NULL;
+    tng__VP8_release_params(ctx);
+    for (i = 0; i < VP8_PARAM_COUNT; i++) {
+        free(ctx->param_spare[i]);
+        ctx->param_spare[i] = NULL;
     }
 
     free(obj_context->format_data);
@@ -535,6 +947,7 @@ static void tng__VP8_trace_slc_params(VASliceParameterBufferVP8 *p) {
 
 static VAStatus tng__VP8_process_picture_param(context_VP8_p ctx, object_buffer_p obj_buffer) {
     ipvr_surface_p target_surface = ctx->obj_context->current_render_target->ipvr_surface;
+    VAStatus vaStatus;
 
     ASSERT(obj_buffer->type == VAPictureParameterBufferType);
     ASSERT(obj_buffer->num_elements == 1);
@@ -548,19 +961,20 @@ static VAStatus tng__VP8_process_picture_param(context_VP8_p ctx, object_buffer_
     }
 
     /* Transfer ownership of VAPictureParameterBufferVP8 data */
-    VAPictureParameterBufferVP8 *pic_params = (VAPictureParameterBufferVP8 *) obj_buffer->buffer_data;
-    if (ctx->pic_params) {
-        free(ctx->pic_params);
-    }
-
-    ctx->pic_params = pic_params;
-    obj_buffer->buffer_data = NULL;
-    obj_buffer->size = 0;
+    tng__VP8_take_param(ctx, VP8_PARAM_PICTURE, (void **)&ctx->pic_params, obj_buffer);
+    VAPictureParameterBufferVP8 *pic_params = ctx->pic_params;
 
 #ifdef DEBUG_TRACE
     tng__VP8_trace_pic_params(pic_params);
 #endif
 
+    if (pic_params->frame_width != ctx->frame_width ||
+        pic_params->frame_height != ctx->frame_height) {
+        vaStatus = tng__VP8_resize(ctx, ctx->obj_context->current_render_target);
+        if (vaStatus != VA_STATUS_SUCCESS)
+            return vaStatus;
+    }
+
     ctx->size_mb = ((ctx->pic_params->frame_width) * (ctx->pic_params->frame_height)) >> 8;
 
      /* port from ui32OperatingMode = mpDestFrame->GetInloopOpMode() */
@@ -604,7 +1018,11 @@ static VAStatus tng__VP8_process_picture_param(context_VP8_p ctx, object_buffer_
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
 
-    return VA_STATUS_SUCCESS;
+    vaStatus = tng__VP8_select_seg_map(ctx);
+    if (vaStatus != VA_STATUS_SUCCESS)
+        return vaStatus;
+
+    return tng__VP8_compile_1st_part_probs(ctx);
 }
 
 static VAStatus
@@ -618,16 +1036,10 @@ tng__VP8_process_probility_param(context_VP8_p ctx, object_buffer_p obj_buffer)
         return VA_STATUS_ERROR_UNKNOWN;
     }
 
-    if (ctx->probs_params) {
-        free(ctx->probs_params);
-    }
-
     /* Transfer ownership of VANodeProbabilityBufferVP8 data */
-    ctx->probs_params = (VAProbabilityDataBufferVP8 *) obj_buffer->buffer_data;
-    obj_buffer->buffer_data = NULL;
-    obj_buffer->size = 0;
+    tng__VP8_take_param(ctx, VP8_PARAM_PROBABILITY, (void **)&ctx->probs_params, obj_buffer);
 
-    return VA_STATUS_SUCCESS;
+    return tng__VP8_compile_2nd_part_probs(ctx);
 }
 
 static VAStatus
@@ -641,13 +1053,7 @@ tng__VP8_process_iq_matrix(context_VP8_p ctx, object_buffer_p obj_buffer) {
      }
 
      /* Transfer ownership of VAIQMatrixBufferVP8 data */
-     if (ctx->iq_params) {
-        free(ctx->iq_params);
-    }
-
-    ctx->iq_params = (VAIQMatrixBufferVP8 *) obj_buffer->buffer_data;
-    obj_buffer->buffer_data = NULL;
-    obj_buffer->size = 0;
+    tng__VP8_take_param(ctx, VP8_PARAM_IQ, (void **)&ctx->iq_params, obj_buffer);
 
     return VA_STATUS_SUCCESS;
 
@@ -710,34 +1116,106 @@ static void tng__VP8_compile_qindex_data(context_VP8_p ctx) {
     }
 }
 
-static void tng__CMDS_registers_write(context_VP8_p ctx) {
-    ipvr_execbuffer_p execbuf = ctx->obj_context->execbuf;
+/*
+ * Compute the registers that normally stay constant for a whole stream,
+ * in the order tng__VP8_write_stream_state() emits them
+ */
+static void tng__VP8_compile_stream_state(context_VP8_p ctx, uint32_t *state) {
     uint32_t reg_value;
 
-    ved_execbuf_rendec_start(execbuf,
-        RENDEC_REGISTER_OFFSET(MSVDX_CMDS, DISPLAY_PICTURE_SIZE));
+    state[VP8_STATE_ENTDEC_BE_CONTROL] = RegEntdecFeControl;
+
+    reg_value = 0;
+    REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1,
+        VP8_BE_PIC_HEIGHT_IN_MBS_LESS1, ((ctx->pic_params->frame_height + 15) >> 4) - 1);
+    REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1,
+        VP8_BE_PIC_WIDTH_IN_MBS_LESS1, ((ctx->pic_params->frame_width + 15) >> 4) - 1);
+    state[VP8_STATE_BE_PIC1] = reg_value;
+
+    reg_value = 0;
+    REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC2,
+        VP8_BE_DECODE_PRED_NOT_COEFFS, 1);
+    state[VP8_STATE_BE_PIC2] = reg_value;
 
-    /* DISPLAY_PICTURE_SIZE */
     reg_value = 0;
     REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_CMDS, DISPLAY_PICTURE_SIZE,
         DISPLAY_PICTURE_WIDTH, (((ctx->pic_params->frame_width + 15) / 16) * 16) - 1);
     REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_CMDS, DISPLAY_PICTURE_SIZE,
         DISPLAY_PICTURE_HEIGHT, (((ctx->pic_params->frame_height + 15) / 16) * 16) - 1);
-    ved_execbuf_rendec_write(execbuf, reg_value);
+    state[VP8_STATE_DISPLAY_PICTURE_SIZE] = reg_value;
 
-    /* CODED_PICTURE_SIZE */
     reg_value = 0;
     REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_CMDS, CODED_PICTURE_SIZE,
         CODED_PICTURE_WIDTH, (((ctx->pic_params->frame_width + 15) / 16) * 16) - 1);
     REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_CMDS, CODED_PICTURE_SIZE,
         CODED_PICTURE_HEIGHT, (((ctx->pic_params->frame_height + 15) / 16) * 16) - 1);
-    ved_execbuf_rendec_write(execbuf, reg_value);
+    state[VP8_STATE_CODED_PICTURE_SIZE] = reg_value;
 
-    /* Set operating mode */
-    ved_execbuf_rendec_write(execbuf, ctx->obj_context->operating_mode);
+    state[VP8_STATE_OPERATING_MODE] = ctx->obj_context->operating_mode;
+
+    reg_value = 0;
+    REGIO_WRITE_FIELD_LITE( reg_value, MSVDX_CMDS, MC_CACHE_CONFIGURATION,
+        CONFIG_REF_OFFSET, ctx->cache_ref_offset);
+    REGIO_WRITE_FIELD_LITE( reg_value, MSVDX_CMDS, MC_CACHE_CONFIGURATION,
+        CONFIG_ROW_OFFSET, ctx->cache_row_offset);
+    state[VP8_STATE_MC_CACHE_CONFIGURATION] = reg_value;
+}
 
+/*
+ * Emit the stream state registers
+ *
+ * With IPVR_VIDEO_SHADOW_REGS the execbuf layer elides the unchanged
+ * writes, otherwise they go out in the blocks they always used
+ */
+static void tng__VP8_write_stream_state(context_VP8_p ctx) {
+    ipvr_execbuffer_p execbuf = ctx->obj_context->execbuf;
+    uint32_t state[VP8_STATE_COUNT];
+
+    tng__VP8_compile_stream_state(ctx, state);
+
+    if (ved_execbuf_state_shadowed(execbuf)) {
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_VEC, CR_VEC_ENTDEC_BE_CONTROL), state[VP8_STATE_ENTDEC_BE_CONTROL]);
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1), state[VP8_STATE_BE_PIC1]);
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC2), state[VP8_STATE_BE_PIC2]);
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_CMDS, DISPLAY_PICTURE_SIZE), state[VP8_STATE_DISPLAY_PICTURE_SIZE]);
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_CMDS, CODED_PICTURE_SIZE), state[VP8_STATE_CODED_PICTURE_SIZE]);
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_CMDS, OPERATING_MODE), state[VP8_STATE_OPERATING_MODE]);
+        ved_execbuf_rendec_write_state(execbuf,
+            RENDEC_REGISTER_OFFSET(MSVDX_CMDS, MC_CACHE_CONFIGURATION), state[VP8_STATE_MC_CACHE_CONFIGURATION]);
+        ved_execbuf_replay_state(execbuf);
+        return;
+    }
+
+    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_VEC, CR_VEC_ENTDEC_BE_CONTROL));
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_ENTDEC_BE_CONTROL]);
+    ved_execbuf_rendec_end(execbuf);
+
+    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1));
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_BE_PIC1]);
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_BE_PIC2]);
+    ved_execbuf_rendec_end(execbuf);
+
+    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, DISPLAY_PICTURE_SIZE));
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_DISPLAY_PICTURE_SIZE]);
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_CODED_PICTURE_SIZE]);
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_OPERATING_MODE]);
     ved_execbuf_rendec_end(execbuf);
 
+    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, MC_CACHE_CONFIGURATION));
+    ved_execbuf_rendec_write(execbuf, state[VP8_STATE_MC_CACHE_CONFIGURATION]);
+    ved_execbuf_rendec_end(execbuf);
+}
+
+static void tng__CMDS_registers_write(context_VP8_p ctx) {
+    ipvr_execbuffer_p execbuf = ctx->obj_context->execbuf;
+    uint32_t reg_value;
+
     /* VP8_LOOP_FILTER_CONTROL */
     ved_execbuf_rendec_start(execbuf,
         RENDEC_REGISTER_OFFSET(MSVDX_CMDS, VP8_LOOP_FILTER_CONTROL));
@@ -796,15 +1274,6 @@ static void tng__CMDS_registers_write(context_VP8_p ctx) {
     ved_execbuf_rendec_write(execbuf, reg_value);
     ved_execbuf_rendec_end(execbuf); 
 
-    ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_CMDS, MC_CACHE_CONFIGURATION));
-    reg_value = 0;
-    REGIO_WRITE_FIELD_LITE( reg_value, MSVDX_CMDS, MC_CACHE_CONFIGURATION,
-        CONFIG_REF_OFFSET, ctx->cache_ref_offset);
-    REGIO_WRITE_FIELD_LITE( reg_value, MSVDX_CMDS, MC_CACHE_CONFIGURATION,
-        CONFIG_ROW_OFFSET, ctx->cache_row_offset);
-    ved_execbuf_rendec_write(execbuf, reg_value);
-    ved_execbuf_rendec_end(execbuf); 
-
     /* ipvr_surface_p forward_ref_surface = ctx->forward_ref_picture->ipvr_surface; */
     /* ipvr_surface_p golden_ref_surface = ctx->golden_ref_picture->ipvr_surface; */
 
@@ -974,7 +1443,8 @@ static void tng__VP8_FE_Registers_Write(context_VP8_p ctx) {
                + 3 * (ctx->slice_params->num_of_partitions - 2) ;
        ved_execbuf_reg_set_address(execbuf,
                REGISTER_OFFSET (MSVDX_VEC_VP8, CR_VEC_VP8_FE_DCT_BASE_ADDRESS),
-            ctx->dec_ctx.slice_data_buffer, ctx->DCT_Base_Address_Offset);
+            ctx->dec_ctx.slice_data_buffer,
+            ctx->dec_ctx.slice_data_buffer_offset + ctx->DCT_Base_Address_Offset);
        ved_execbuf_reg_end_block(execbuf);
    }
 
@@ -985,41 +1455,13 @@ static void tng__VP8_BE_Registers_Write(context_VP8_p ctx) {
     uint32_t reg_value;
 
     {
-        /* BE Section */
-        ved_execbuf_rendec_start(execbuf,
-            RENDEC_REGISTER_OFFSET(MSVDX_VEC, CR_VEC_ENTDEC_BE_CONTROL));
-        ved_execbuf_rendec_write(execbuf, RegEntdecFeControl);
-        ved_execbuf_rendec_end(execbuf);
-    }
-
-    {
-        /* PIC0 */
+        /* BE Section, PIC0 (ENTDEC_BE_CONTROL, PIC1 and PIC2 are part of the stream state) */
         ved_execbuf_rendec_start(execbuf,
             RENDEC_REGISTER_OFFSET(MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC0));
         reg_value = 0;
         REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC0,
             VP8_BE_FRAME_TYPE, (ctx->pic_params->pic_fields.bits.key_frame == 0)? 0 : 1);
         ved_execbuf_rendec_write(execbuf, reg_value);
-
-        /* PIC1 */
-        // ved_execbuf_rendec_start(execbuf, RENDEC_REGISTER_OFFSET(MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1));
-        reg_value = 0;
-        REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1,
-            VP8_BE_PIC_HEIGHT_IN_MBS_LESS1, ((ctx->pic_params->frame_height + 15) >> 4) - 1);
-        REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC1,
-            VP8_BE_PIC_WIDTH_IN_MBS_LESS1, ((ctx->pic_params->frame_width + 15) >> 4) - 1);
-        ved_execbuf_rendec_write(execbuf, reg_value);
-        ved_execbuf_rendec_end(execbuf);
-    }
-
-    {
-        /* PIC2 */
-        ved_execbuf_rendec_start(execbuf,
-            RENDEC_REGISTER_OFFSET(MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC2));
-        reg_value = 0;
-        REGIO_WRITE_FIELD_LITE(reg_value, MSVDX_VEC_VP8, CR_VEC_VP8_BE_PIC2,
-            VP8_BE_DECODE_PRED_NOT_COEFFS, 1);
-        ved_execbuf_rendec_write(execbuf, reg_value);
         ved_execbuf_rendec_end(execbuf);
     }
 
@@ -1164,6 +1606,40 @@ tng_KeyFrame_BModeProbsDataCompile(const Probability* ui8_probs_to_write, uint32
     }
 }
 
+/*
+ * The key frame B-mode probabilities never change, so their layout is
+ * compiled once into a BO that every VP8 context of the driver DMAs from
+ */
+static VAStatus tng__VP8_init_key_frame_probs(object_context_p obj_context, uint32_t size)
+{
+    ipvr_driver_data_p driver_data = obj_context->driver_data;
+    VAStatus vaStatus = VA_STATUS_SUCCESS;
+    drm_ipvr_bo *bo;
+
+    pthread_mutex_lock(&driver_data->drm_mutex);
+    if (driver_data->vp8_key_frame_probs)
+        goto out;
+
+    bo = drm_ipvr_gem_bo_alloc(driver_data->bufmgr, NULL,
+        "VED-VP8-key_frame_probs", size, 0, IPVR_CACHE_WRITECOMBINE);
+    if (!bo) {
+        vaStatus = VA_STATUS_ERROR_ALLOCATION_FAILED;
+        goto out;
+    }
+    if (drm_ipvr_gem_bo_map(bo, 1)) {
+        drm_ipvr_gem_bo_unreference(bo);
+        vaStatus = VA_STATUS_ERROR_UNKNOWN;
+        goto out;
+    }
+    memset(bo->virt, 0, size);
+    tng_KeyFrame_BModeProbsDataCompile((const Probability*)b_mode_prob, bo->virt);
+    drm_ipvr_gem_bo_unmap(bo);
+    driver_data->vp8_key_frame_probs = bo;
+out:
+    pthread_mutex_unlock(&driver_data->drm_mutex);
+    return vaStatus;
+}
+
 /***********************************************************************************
 * Description        : Write probability data in buffer according to MSVDX setting.
 ************************************************************************************/
@@ -1212,89 +1688,265 @@ tng_InterFrame_MVContextProbsDataCompile(uint8_t* ui8_probs_to_write, uint32_t*
     }
 }
 
-/***********************************************************************************
-* Description        : Write probability data in buffer according to MSVDX setting.
-************************************************************************************/
+/*
+ * DCT coefficient probabilities are 4x8x3 groups of
+ * CABAC_LSR_CoefficientProb_Valid bytes, each permuted into
+ * CABAC_LSR_CoefficientProb_Stride bytes. The vector versions handle four
+ * groups at a time: 44 source bytes, three 16 byte loads, become 48
+ * destination bytes, three stores, each output vector OR-ing one byte
+ * shuffle of every source vector.
+ */
+#define VP8_COEF_GROUPS         (4 * 8 * 3)
+#define VP8_COEF_BLOCK_GROUPS   4
+
+static uint8_t tng__VP8_coef_shuffle[3][3][16];
+static void (*tng__VP8_coef_repack)(const Probability *, uint32_t *);
+static pthread_once_t tng__VP8_coef_repack_once = PTHREAD_ONCE_INIT;
+
+/* Scalar reference, also used for the groups following the last full block */
 static void
-tng_DCT_Coefficient_ProbsDataCompile(Probability* ui8_probs_to_write, uint32_t* ui32_probs_buffer) {
-    uint32_t dim0, dim1, dim2;
+tng__VP8_coef_repack_groups(const Probability* ui8_probs_to_write, uint32_t* ui32_probs_buffer,
+                            uint32_t group, uint32_t count) {
     uint32_t i, j, address;
-    uint32_t src_tab_offset = 0;
+    uint32_t src_tab_offset = group * CABAC_LSR_CoefficientProb_Valid;
+
+    address = group * (CABAC_LSR_CoefficientProb_Stride >> 2);
+
+    for (; count; count--) {
+        j =0;
+        for (i =0 ; i < CABAC_LSR_CoefficientProb_Stride ; i += 4) {
+            *(ui32_probs_buffer + address + j++ ) =
+                  (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i] + src_tab_offset]
+                | (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i+1] + src_tab_offset] << 8
+                | (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i+2] + src_tab_offset] << 16
+                | (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i+3] + src_tab_offset] << 24;
+        }
+        /* increment the address by the stride */
+        address +=  (CABAC_LSR_CoefficientProb_Stride >> 2);
+        /* increment source table offset */
+        src_tab_offset += CABAC_LSR_CoefficientProb_Valid;
+    }
+}
 
-    address = 0;
+static void
+tng__VP8_coef_repack_c(const Probability* ui8_probs_to_write, uint32_t* ui32_probs_buffer) {
+    tng__VP8_coef_repack_groups(ui8_probs_to_write, ui32_probs_buffer, 0, VP8_COEF_GROUPS);
+}
 
-    for(dim2 = 0; dim2 < 4; dim2++) {
-        for(dim1 = 0; dim1 < 8; dim1++) {
-            for(dim0 = 0; dim0 < 3; dim0++) { 
-                j =0;
-                for (i =0 ; i < CABAC_LSR_CoefficientProb_Stride ; i += 4) {
-                    *(ui32_probs_buffer + address + j++ ) =
-                          (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i] + src_tab_offset]
-                        | (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i+1] + src_tab_offset] << 8
-                        | (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i+2] + src_tab_offset] << 16
-                        | (uint32_t)ui8_probs_to_write[CABAC_LSR_CoefficientProb_ToIdxMap[i+3] + src_tab_offset] << 24;
-                    
-                }
-                /* increment the address by the stride */
-                address +=  (CABAC_LSR_CoefficientProb_Stride >> 2);
-                /* increment source table offset */
-                src_tab_offset += CABAC_LSR_CoefficientProb_Valid;
-            }
+/* Full blocks whose three source loads stay inside the table */
+#define VP8_COEF_VECTOR_GROUPS \
+    (((VP8_COEF_GROUPS * 11 - 48) / (VP8_COEF_BLOCK_GROUPS * 11) + 1) * VP8_COEF_BLOCK_GROUPS)
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("ssse3")))
+static void
+tng__VP8_coef_repack_ssse3(const Probability* ui8_probs_to_write, uint32_t* ui32_probs_buffer) {
+    __m128i shuffle[3][3], in[3], out;
+    uint32_t group, k, m;
+
+    for (k = 0; k < 3; k++)
+        for (m = 0; m < 3; m++)
+            shuffle[k][m] = _mm_loadu_si128((const __m128i *)tng__VP8_coef_shuffle[k][m]);
+
+    for (group = 0; group < VP8_COEF_VECTOR_GROUPS; group += VP8_COEF_BLOCK_GROUPS) {
+        const uint8_t *src = ui8_probs_to_write + group * CABAC_LSR_CoefficientProb_Valid;
+        uint8_t *dst = (uint8_t *)ui32_probs_buffer + group * CABAC_LSR_CoefficientProb_Stride;
+
+        for (m = 0; m < 3; m++)
+            in[m] = _mm_loadu_si128((const __m128i *)(src + 16 * m));
+        for (k = 0; k < 3; k++) {
+            out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], shuffle[k][0]),
+                                            _mm_shuffle_epi8(in[1], shuffle[k][1])),
+                               _mm_shuffle_epi8(in[2], shuffle[k][2]));
+            _mm_storeu_si128((__m128i *)(dst + 16 * k), out);
         }
     }
+    tng__VP8_coef_repack_groups(ui8_probs_to_write, ui32_probs_buffer,
+        VP8_COEF_VECTOR_GROUPS, VP8_COEF_GROUPS - VP8_COEF_VECTOR_GROUPS);
+}
+#endif
+
+#if defined(__aarch64__)
+static void
+tng__VP8_coef_repack_neon(const Probability* ui8_probs_to_write, uint32_t* ui32_probs_buffer) {
+    uint8x16_t shuffle[3][3], in[3], out;
+    uint32_t group, k, m;
+
+    for (k = 0; k < 3; k++)
+        for (m = 0; m < 3; m++)
+            shuffle[k][m] = vld1q_u8(tng__VP8_coef_shuffle[k][m]);
+
+    for (group = 0; group < VP8_COEF_VECTOR_GROUPS; group += VP8_COEF_BLOCK_GROUPS) {
+        const uint8_t *src = ui8_probs_to_write + group * CABAC_LSR_CoefficientProb_Valid;
+        uint8_t *dst = (uint8_t *)ui32_probs_buffer + group * CABAC_LSR_CoefficientProb_Stride;
+
+        for (m = 0; m < 3; m++)
+            in[m] = vld1q_u8(src + 16 * m);
+        for (k = 0; k < 3; k++) {
+            /* out of range indices, 0x80, select 0 */
+            out = vorrq_u8(vorrq_u8(vqtbl1q_u8(in[0], shuffle[k][0]),
+                                    vqtbl1q_u8(in[1], shuffle[k][1])),
+                           vqtbl1q_u8(in[2], shuffle[k][2]));
+            vst1q_u8(dst + 16 * k, out);
+        }
+    }
+    tng__VP8_coef_repack_groups(ui8_probs_to_write, ui32_probs_buffer,
+        VP8_COEF_VECTOR_GROUPS, VP8_COEF_GROUPS - VP8_COEF_VECTOR_GROUPS);
+}
+#endif
+
+/*
+ * Builds the shuffle masks and picks the repack routine for this CPU.
+ * A vector routine is only used after it matched the scalar reference.
+ */
+static void tng__VP8_coef_repack_init(void)
+{
+    Probability probs[VP8_COEF_GROUPS * 11];
+    uint32_t ref[VP8_COEF_GROUPS * 3], out[VP8_COEF_GROUPS * 3];
+    uint32_t group, i, o, src;
+
+    ASSERT(CABAC_LSR_CoefficientProb_Valid == 11 && CABAC_LSR_CoefficientProb_Stride == 12);
+    memset(tng__VP8_coef_shuffle, 0x80, sizeof(tng__VP8_coef_shuffle));
+    for (group = 0; group < VP8_COEF_BLOCK_GROUPS; group++) {
+        for (i = 0; i < CABAC_LSR_CoefficientProb_Stride; i++) {
+            o = group * CABAC_LSR_CoefficientProb_Stride + i;
+            src = group * CABAC_LSR_CoefficientProb_Valid + CABAC_LSR_CoefficientProb_ToIdxMap[i];
+            tng__VP8_coef_shuffle[o / 16][src / 16][o % 16] = src % 16;
+        }
+    }
+
+    tng__VP8_coef_repack = tng__VP8_coef_repack_c;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        tng__VP8_coef_repack = tng__VP8_coef_repack_ssse3;
+#elif defined(__aarch64__)
+    tng__VP8_coef_repack = tng__VP8_coef_repack_neon;
+#endif
+    if (tng__VP8_coef_repack == tng__VP8_coef_repack_c)
+        return;
+
+    for (i = 0; i < sizeof(probs); i++)
+        probs[i] = (Probability)(i * 37 + 11);
+    tng__VP8_coef_repack_c(probs, ref);
+    tng__VP8_coef_repack(probs, out);
+    if (memcmp(ref, out, sizeof(ref))) {
+        drv_debug_msg(VIDEO_DEBUG_ERROR, "%s vector repack mismatch, using scalar code\n", __func__);
+        tng__VP8_coef_repack = tng__VP8_coef_repack_c;
+    }
 }
 
 /***********************************************************************************
-* Description        : programme the DMA to send probability data.
+* Description        : Write probability data in buffer according to MSVDX setting.
 ************************************************************************************/
 static void
-tng__VP8_set_probility_reg(context_VP8_p ctx) {
-    ipvr_execbuffer_p execbuf = ctx->obj_context->execbuf;
-    uint32_t *probs_buffer_1stPart , *probs_buffer_2ndPart;
+tng_DCT_Coefficient_ProbsDataCompile(Probability* ui8_probs_to_write, uint32_t* ui32_probs_buffer) {
+    pthread_once(&tng__VP8_coef_repack_once, tng__VP8_coef_repack_init);
+    tng__VP8_coef_repack(ui8_probs_to_write, ui32_probs_buffer);
+}
+
+/*
+ * Points probability_data_1st_part at the inter frame mode and MV tables
+ * of the current picture, compiling them unless already cached
+ */
+static VAStatus tng__VP8_compile_1st_part_probs(context_VP8_p ctx)
+{
+    VAPictureParameterBufferVP8 *pic_params = ctx->pic_params;
+    uint8_t key[sizeof(pic_params->y_mode_probs) + sizeof(pic_params->uv_mode_probs) +
+                sizeof(pic_params->mv_probs)];
+    uint32_t *probs_buffer_1stPart;
+    drm_ipvr_bo *bo;
+    int compile;
+
+    /* key frames use the shared table, see tng__VP8_init_key_frame_probs */
+    if (pic_params->pic_fields.bits.key_frame == 0)
+        return VA_STATUS_SUCCESS;
+
+    memcpy(key, pic_params->y_mode_probs, sizeof(pic_params->y_mode_probs));
+    memcpy(key + sizeof(pic_params->y_mode_probs), pic_params->uv_mode_probs,
+        sizeof(pic_params->uv_mode_probs));
+    memcpy(key + sizeof(pic_params->y_mode_probs) + sizeof(pic_params->uv_mode_probs),
+        pic_params->mv_probs, sizeof(pic_params->mv_probs));
+
+    bo = tng__VP8_prob_cache_get(ctx, 0, key, sizeof(key),
+        ctx->probability_data_1st_part_size, &compile);
+    if (!bo)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    ctx->probability_data_1st_part = bo;
+    if (!compile)
+        return VA_STATUS_SUCCESS;
 
-    /* First write the data for the first partition */
     /* Write the probability data in the probability data buffer */
-    drm_ipvr_gem_bo_map(ctx->probability_data_1st_part, 1);
-    probs_buffer_1stPart = ctx->probability_data_1st_part->virt;
+    drm_ipvr_gem_bo_map(bo, 1);
+    probs_buffer_1stPart = bo->virt;
     if(NULL == probs_buffer_1stPart) {
-        drv_debug_msg(VIDEO_DEBUG_GENERAL, "tng__VP8_set_probility_reg: map buffer fail\n");
-        return;
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s: map buffer fail\n", __func__);
+        tng__VP8_prob_cache_drop(ctx, 0, bo);
+        return VA_STATUS_ERROR_UNKNOWN;
     }
-    {
-        memset(probs_buffer_1stPart, 0, ctx->probability_data_1st_part_size);
-        if(ctx->pic_params->pic_fields.bits.key_frame == 0) {
-            tng_KeyFrame_BModeProbsDataCompile((const Probability*)b_mode_prob, probs_buffer_1stPart);
-        } else {
-            tng_InterFrame_YModeProbsDataCompile(ctx->pic_params->y_mode_probs, probs_buffer_1stPart);
+    memset(probs_buffer_1stPart, 0, ctx->probability_data_1st_part_size);
+    tng_InterFrame_YModeProbsDataCompile(pic_params->y_mode_probs, probs_buffer_1stPart);
 
-            probs_buffer_1stPart += ( CABAC_LSR_InterFrame_UVModeProb_Address >> 2);
-            tng_InterFrame_UVModeProbsDataCompile(ctx->pic_params->uv_mode_probs, probs_buffer_1stPart);
+    probs_buffer_1stPart += ( CABAC_LSR_InterFrame_UVModeProb_Address >> 2);
+    tng_InterFrame_UVModeProbsDataCompile(pic_params->uv_mode_probs, probs_buffer_1stPart);
 
-            probs_buffer_1stPart += (CABAC_LSR_InterFrame_MVContextProb_Address >>2) - ( CABAC_LSR_InterFrame_UVModeProb_Address >> 2);
-            tng_InterFrame_MVContextProbsDataCompile((unsigned char*)ctx->pic_params->mv_probs, probs_buffer_1stPart);
-        }
+    probs_buffer_1stPart += (CABAC_LSR_InterFrame_MVContextProb_Address >>2) - ( CABAC_LSR_InterFrame_UVModeProb_Address >> 2);
+    tng_InterFrame_MVContextProbsDataCompile((unsigned char*)pic_params->mv_probs, probs_buffer_1stPart);
+
+    drm_ipvr_gem_bo_unmap(bo);
+    return VA_STATUS_SUCCESS;
+}
+
+/*
+ * Points probability_data_2nd_part, preloaded for the slice, at the DCT
+ * coefficient tables of the current picture, compiling them unless already
+ * cached
+ */
+static VAStatus tng__VP8_compile_2nd_part_probs(context_VP8_p ctx)
+{
+    uint32_t *probs_buffer_2ndPart;
+    drm_ipvr_bo *bo;
+    int compile;
+
+    bo = tng__VP8_prob_cache_get(ctx, 1, (const uint8_t *)ctx->probs_params->dct_coeff_probs,
+        sizeof(ctx->probs_params->dct_coeff_probs), ctx->probability_data_2nd_part_size, &compile);
+    if (!bo)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    ctx->probability_data_2nd_part = bo;
+    ctx->dec_ctx.preload_buffer = bo;
+    if (!compile)
+        return VA_STATUS_SUCCESS;
 
-        drm_ipvr_gem_bo_unmap(ctx->probability_data_1st_part);
-        ved_execbuf_dma_write_execbuf(execbuf, ctx->probability_data_1st_part, 0,
-                                    ctx->probability_data_1st_part_size, 0,
-                                    DMA_TYPE_PROBABILITY_DATA);
-    }
-    
     /* Write the probability data for the second partition and create a linked list */ 
-    drm_ipvr_gem_bo_map(ctx->probability_data_2nd_part, 1);
-    probs_buffer_2ndPart = ctx->probability_data_2nd_part->virt;
+    drm_ipvr_gem_bo_map(bo, 1);
+    probs_buffer_2ndPart = bo->virt;
     if(NULL == probs_buffer_2ndPart) {
-        drv_debug_msg(VIDEO_DEBUG_GENERAL, "tng__VP8_set_probility_reg: map buffer fail\n");
-        return;
+        drv_debug_msg(VIDEO_DEBUG_GENERAL, "%s: map buffer fail\n", __func__);
+        tng__VP8_prob_cache_drop(ctx, 1, bo);
+        return VA_STATUS_ERROR_UNKNOWN;
     }
+    memset(probs_buffer_2ndPart, 0, ctx->probability_data_2nd_part_size);
+    /* for any other partition */
+    tng_DCT_Coefficient_ProbsDataCompile((Probability*)ctx->probs_params->dct_coeff_probs, probs_buffer_2ndPart);
 
-    {
-        memset(probs_buffer_2ndPart, 0, ctx->probability_data_2nd_part_size);
-        /* for any other partition */
-        tng_DCT_Coefficient_ProbsDataCompile((Probability*)ctx->probs_params->dct_coeff_probs, probs_buffer_2ndPart);
+    drm_ipvr_gem_bo_unmap(bo);
+    return VA_STATUS_SUCCESS;
+}
 
-        drm_ipvr_gem_bo_unmap(ctx->probability_data_2nd_part);
-    }
+/***********************************************************************************
+* Description        : programme the DMA to send probability data.
+************************************************************************************/
+static void
+tng__VP8_set_probility_reg(context_VP8_p ctx) {
+    ipvr_execbuffer_p execbuf = ctx->obj_context->execbuf;
+    drm_ipvr_bo *probs_1st_part = ctx->probability_data_1st_part;
+
+    /* the 2nd partition tables are preloaded, see tng__VP8_compile_2nd_part_probs */
+    if(ctx->pic_params->pic_fields.bits.key_frame == 0)
+        probs_1st_part = ctx->obj_context->driver_data->vp8_key_frame_probs;
+    ved_execbuf_dma_write_execbuf(execbuf, probs_1st_part, 0,
+                                ctx->probability_data_1st_part_size, 0,
+                                DMA_TYPE_PROBABILITY_DATA);
 }
 
 static void tng__VP8_begin_slice(context_DEC_p dec_ctx, VASliceParameterBufferBase *vld_slice_param)
@@ -1311,6 +1963,7 @@ static void tng__VP8_process_slice_data(context_DEC_p dec_ctx, VASliceParameterB
 {
     context_VP8_p ctx = (context_VP8_p)dec_ctx;
 
+    tng__VP8_write_stream_state(ctx);
     tng__CMDS_registers_write(ctx);
     tng__VP8_FE_Registers_Write(ctx);
     tng__VP8_BE_Registers_Write(ctx);
@@ -1339,106 +1992,24 @@ static VAStatus tng_VP8_BeginPicture(
     INIT_CONTEXT_VP8
 
     VAStatus st = VA_STATUS_ERROR_ALLOCATION_FAILED;
-    if (ctx->pic_params) {
-        free(ctx->pic_params);
-        ctx->pic_params = NULL;
-    }
-
-    if (ctx->probs_params) {
-        free(ctx->probs_params);
-        ctx->probs_params = NULL;
-    }
-
-    if (ctx->iq_params) {
-        free(ctx->iq_params);
-        ctx->iq_params = NULL;
-    }
+    tng__VP8_release_params(ctx);
     /* ctx->table_stats[VP8_VLC_NUM_TABLES-1].size = 16; */
     ctx->slice_count = 0;
 
-    /* Create mem resource for current picture macroblock data to be stored */
-    ctx->cur_pic_buffer = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-cur_pic_buffer", ctx->buffer_size,
-        0, IPVR_CACHE_UNCACHED);
-    if (!ctx->cur_pic_buffer)
-        goto err;
-
-    /* Create mem resource for storing 1st partition .*/
-    ctx->buffer_1st_part = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-buffer_1st_part", ctx->buffer_size,
-        0, IPVR_CACHE_UNCACHED);
-    if (!ctx->buffer_1st_part)
-        goto err;
-
-    ctx->segID_buffer = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-segID_buffer", ctx->segid_size, 0,
-        IPVR_CACHE_UNCACHED);
-    if (!ctx->segID_buffer)
-        goto err;
-
-    /* Create mem resource for PIC MB Flags .*/ 
-    /* one MB would take 2 bits to store Y2 flag and mb_skip_coeff flag, so size would be same as ui32segidsize */
-    ctx->MB_flags_buffer = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-MB_flags_buffer", ctx->segid_size, 0,
-        IPVR_CACHE_UNCACHED);
-    if (!ctx->MB_flags_buffer)
-        goto err;
-
-    /* allocate device memory for prbability table for the both the partitions.*/
-    ctx->probability_data_1st_part = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-probability_data_1st_part",
-        ctx->probability_data_1st_part_size, 0, IPVR_CACHE_WRITECOMBINE);
-    if (!ctx->probability_data_1st_part)
-        goto err;
-
-    /* allocate device memory for prbability table for the both the partitions.*/
-    ctx->probability_data_2nd_part = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-probability_data_2nd_part",
-        ctx->probability_data_2nd_part_size, 0, IPVR_CACHE_WRITECOMBINE);
-    if (!ctx->probability_data_2nd_part)
-        goto err;
-
-    ctx->intra_buffer = drm_ipvr_gem_bo_alloc(obj_context->driver_data->bufmgr,
-        ctx->obj_context->ipvr_ctx, "VED-VP8-intra_buffer", INTRA_BUFFER_SIZE,
-        0, IPVR_CACHE_UNCACHED);
-    if (!ctx->intra_buffer)
+    ctx->pic_set_idx = (ctx->pic_set_idx + 1) % ctx->pic_set_count;
+    if (tng__VP8_alloc_scratch(ctx))
         goto err;
 
     st = vld_dec_BeginPicture(&ctx->dec_ctx, obj_context);
     if (st != VA_STATUS_SUCCESS)
         goto err;
 
-    ctx->dec_ctx.preload_buffer = ctx->probability_data_2nd_part;
+    /* the probability BOs are picked as their parameter buffers arrive */
+    ctx->probability_data_1st_part = NULL;
+    ctx->probability_data_2nd_part = NULL;
+    ctx->dec_ctx.preload_buffer = NULL;
     return VA_STATUS_SUCCESS;
 err:
-    if (ctx->cur_pic_buffer) {
-        drm_ipvr_gem_bo_unreference(ctx->cur_pic_buffer);
-        ctx->cur_pic_buffer = NULL;
-    }
-    if (ctx->buffer_1st_part) {
-        drm_ipvr_gem_bo_unreference(ctx->buffer_1st_part);
-        ctx->buffer_1st_part = NULL;
-    }
-    if (ctx->segID_buffer) {
-        drm_ipvr_gem_bo_unreference(ctx->segID_buffer);
-        ctx->segID_buffer = NULL;
-    }
-    if (ctx->MB_flags_buffer) {
-        drm_ipvr_gem_bo_unreference(ctx->MB_flags_buffer);
-        ctx->MB_flags_buffer = NULL;
-    }
-    if (ctx->probability_data_1st_part) {
-        drm_ipvr_gem_bo_unreference(ctx->probability_data_1st_part);
-        ctx->probability_data_1st_part = NULL;
-    }
-    if (ctx->probability_data_2nd_part) {
-        drm_ipvr_gem_bo_unreference(ctx->probability_data_2nd_part);
-        ctx->probability_data_2nd_part = NULL;
-    }
-    if (ctx->intra_buffer) {
-        drm_ipvr_gem_bo_unreference(ctx->intra_buffer);
-        ctx->intra_buffer = NULL;
-    }
     ctx->dec_ctx.preload_buffer = NULL;
     return st;
 }
@@ -1545,41 +2116,14 @@ static VAStatus tng_VP8_EndPicture(
     }
 #endif
 
-    if (ipvr_execbuffer_run(obj_context->execbuf)) {
+    if (ved_context_end_execbuf(obj_context)) {
         return VA_STATUS_ERROR_UNKNOWN;
     }
 
     vld_dec_EndPicture(&ctx->dec_ctx);
-    drm_ipvr_gem_bo_unreference(ctx->cur_pic_buffer);
-    drm_ipvr_gem_bo_unreference(ctx->buffer_1st_part);
-    drm_ipvr_gem_bo_unreference(ctx->segID_buffer);
-    drm_ipvr_gem_bo_unreference(ctx->MB_flags_buffer);
-    drm_ipvr_gem_bo_unreference(ctx->probability_data_1st_part);
-    drm_ipvr_gem_bo_unreference(ctx->probability_data_2nd_part);
-    drm_ipvr_gem_bo_unreference(ctx->intra_buffer);
-    ctx->cur_pic_buffer = NULL;
-    ctx->buffer_1st_part = NULL;
-    ctx->segID_buffer = NULL;
-    ctx->MB_flags_buffer = NULL;
-    ctx->probability_data_1st_part = NULL;
-    ctx->probability_data_2nd_part = NULL;
-    ctx->intra_buffer = NULL;
     ctx->dec_ctx.preload_buffer = NULL;
 
-    if (ctx->pic_params) {
-        free(ctx->pic_params);
-        ctx->pic_params = NULL;
-    }
-
-    if (ctx->probs_params) {
-        free(ctx->probs_params);
-        ctx->probs_params = NULL;
-    }
-
-    if (ctx->iq_params) {
-        free(ctx->iq_params);
-        ctx->iq_params = NULL;
-    }
+    tng__VP8_release_params(ctx);
 
     return VA_STATUS_SUCCESS;
 }